@@ -0,0 +1,289 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+/* Line splitting microbenchmark.
+ *
+ * Feeds a buffer to the two ways narc has split file reads into lines,
+ * one read-sized chunk at a time, and reports the throughput of each:
+ *
+ *   bytewise  the original loop, copying every byte into the current
+ *             line, clearing the line buffer before each line and
+ *             detecting repeats with strcmp
+ *   memchr    split_lines from src/split.c, the one narcd runs, finding
+ *             the newlines with memchr and handing lines on as slices of
+ *             the read buffer, only a line split across two reads is
+ *             copied
+ *
+ * Messages are not sent anywhere. The handle_piece below stands in for
+ * the one in stream.c, it detects repeats like the original loop did and
+ * counts the lines, so the numbers are the cost of the splitting alone.
+ *
+ *   split_lines [-c chunk-size] [-r rounds] [file]
+ *
+ * Without a file, 64mb of generated log lines are used. */
+
+#include "stream.h"
+#include "split.h"
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <time.h>	/* time types */
+
+#define BENCH_MAX_MESSAGE_SIZE	1024	/* line buffer of the original loop */
+#define BENCH_GENERATED_SIZE	(64*1024*1024)
+#define BENCH_DEFAULT_CHUNK	4096
+#define BENCH_DEFAULT_ROUNDS	5
+
+/* What a submitted line costs here, kept out of reach of the optimizer. */
+static volatile unsigned long long sink_lines = 0;
+static volatile unsigned long long sink_bytes = 0;
+
+/*============================ Utility functions ============================ */
+
+static void
+submit(size_t len)
+{
+	sink_lines++;
+	sink_bytes += len;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Log-like lines of 40 to 240 bytes, one in eight repeating the one
+ * before it. */
+static char
+*generate_lines(size_t size)
+{
+	char *buf = malloc(size), *p = buf;
+	unsigned int seed = 42, len = 0, n;
+	size_t i;
+
+	while ((size_t)(p - buf) < size) {
+		seed = seed * 1103515245 + 12345;
+		if (len == 0 || (seed >> 16) % 8 != 0)
+			len = 40 + (seed >> 8) % 200;
+		n = len;
+		if ((size_t)(p - buf) + n + 1 > size)
+			n = size - (p - buf) - 1;
+		for (i = 0; i < n; i++)
+			p[i] = 'a' + (i * 7 + len) % 26;
+		p += n;
+		*p++ = '\n';
+	}
+	return buf;
+}
+
+static char
+*read_file(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "r");
+	char *buf;
+	long len;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buf = malloc(len + 1);
+	if (fread(buf, 1, len, fp) != (size_t)len) {
+		perror(path);
+		exit(1);
+	}
+	fclose(fp);
+
+	*size = len;
+	return buf;
+}
+
+/*============================== Splitters ================================== */
+
+typedef struct {
+	char	*current_line;
+	char	*previous_line;
+	size_t	previous_length;
+	int	index;
+	int	repeat_count;
+} bench_stream;
+
+/* The loop narc used before memchr, minus the sends. */
+static void
+split_bytewise(bench_stream *stream, const char *buf, size_t size)
+{
+	size_t i;
+	char *tmp;
+
+	for (i = 0; i < size; i++) {
+		if (stream->index == 0)
+			memset(stream->current_line, '\0', BENCH_MAX_MESSAGE_SIZE);
+
+		if (buf[i] == '\n' || stream->index == BENCH_MAX_MESSAGE_SIZE - 1) {
+			stream->current_line[stream->index] = '\0';
+
+			if (strcmp(stream->current_line, stream->previous_line) == 0) {
+				stream->repeat_count++;
+				memset(stream->current_line, '\0', BENCH_MAX_MESSAGE_SIZE);
+				stream->index = 0;
+				continue;
+			}
+
+			submit(stream->index);
+			stream->repeat_count = 0;
+
+			tmp = stream->previous_line;
+			stream->previous_line = stream->current_line;
+			stream->current_line = tmp;
+			stream->index = 0;
+		} else {
+			stream->current_line[stream->index] = buf[i];
+			stream->index += 1;
+		}
+	}
+}
+
+/* Replaces handle_piece from stream.c for split_lines. */
+void
+handle_piece(narc_stream *stream, char *line, int len, int last)
+{
+	if (len == stream->previous_length && memcmp(line, stream->previous_line, len) == 0) {
+		stream->repeat_count++;
+		return;
+	}
+
+	submit(len);
+	stream->repeat_count = 0;
+
+	stream->previous_line   = sdscpylen(stream->previous_line, line, len);
+	stream->previous_length = len;
+}
+
+/*================================== Main =================================== */
+
+static double
+throughput(size_t size, double elapsed)
+{
+	return size / elapsed / (1024 * 1024);
+}
+
+static double
+run_bytewise(const char *buf, size_t size, size_t chunk, int rounds)
+{
+	char current[BENCH_MAX_MESSAGE_SIZE], previous[BENCH_MAX_MESSAGE_SIZE];
+	bench_stream stream;
+	double best = 0, start, elapsed;
+	size_t off;
+	int r;
+
+	for (r = 0; r < rounds; r++) {
+		memset(current, 0, sizeof(current));
+		memset(previous, 0, sizeof(previous));
+		stream.current_line    = current;
+		stream.previous_line   = previous;
+		stream.previous_length = 0;
+		stream.index           = 0;
+		stream.repeat_count    = 0;
+
+		start = now();
+		for (off = 0; off < size; off += chunk)
+			split_bytewise(&stream, buf + off, size - off < chunk ? size - off : chunk);
+		elapsed = now() - start;
+
+		if (best == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return throughput(size, best);
+}
+
+/* The stream holds only what split_lines and the stub handle_piece use,
+ * lines over max-message-size are split like the original loop did. */
+static double
+run_split_lines(char *buf, size_t size, size_t chunk, int rounds)
+{
+	narc_stream_opts opts;
+	narc_stream stream;
+	double best = 0, start, elapsed;
+	size_t off;
+	int r;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.split_long_lines = 1;
+
+	for (r = 0; r < rounds; r++) {
+		memset(&stream, 0, sizeof(stream));
+		stream.opts             = &opts;
+		stream.max_message_size = BENCH_MAX_MESSAGE_SIZE - 1;
+		stream.current_line     = sdsempty();
+		stream.previous_line    = sdsempty();
+
+		start = now();
+		for (off = 0; off < size; off += chunk) {
+			stream.offset = off;
+			split_lines(&stream, buf + off, size - off < chunk ? size - off : chunk);
+		}
+		elapsed = now() - start;
+
+		sdsfree(stream.current_line);
+		sdsfree(stream.previous_line);
+
+		if (best == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return throughput(size, best);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = BENCH_GENERATED_SIZE, chunk = BENCH_DEFAULT_CHUNK;
+	int rounds = BENCH_DEFAULT_ROUNDS, j;
+	unsigned long long lines, vector_lines;
+	double bytewise, vector;
+	char *buf = NULL;
+
+	for (j = 1; j < argc; j++) {
+		if (!strcmp(argv[j], "-c") && j + 1 < argc) {
+			chunk = strtoul(argv[++j], NULL, 10);
+		} else if (!strcmp(argv[j], "-r") && j + 1 < argc) {
+			rounds = atoi(argv[++j]);
+		} else if (argv[j][0] != '-' && buf == NULL) {
+			buf = read_file(argv[j], &size);
+		} else {
+			fprintf(stderr, "Usage: %s [-c chunk-size] [-r rounds] [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (chunk == 0 || rounds < 1) {
+		fprintf(stderr, "chunk-size and rounds must be positive\n");
+		return 1;
+	}
+	if (buf == NULL)
+		buf = generate_lines(size);
+
+	bytewise     = run_bytewise(buf, size, chunk, rounds);
+	lines        = sink_lines;
+	vector       = run_split_lines(buf, size, chunk, rounds);
+	vector_lines = sink_lines - lines;
+
+	printf("%zu bytes in %zu byte chunks, %llu lines sent per round\n",
+		size, chunk, lines / rounds);
+	// the original loop dropped a byte at each cut of an overlong line
+	if (lines != vector_lines)
+		printf("split_lines sent %llu lines per round\n", vector_lines / rounds);
+	printf("bytewise  %8.1f MB/s\n", bytewise);
+	printf("memchr    %8.1f MB/s  (%.1fx)\n", vector, vector / bytewise);
+
+	free(buf);
+	return 0;
+}
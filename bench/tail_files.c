@@ -0,0 +1,321 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+/* File io backend benchmark.
+ *
+ * Runs narcd on a glob stream over N files, with UV_USE_IO_URING set to
+ * 0 and then to 1, and collects the messages on a local tcp socket:
+ *
+ *   open   the N files are created with one line each, the time until
+ *          all N lines arrived covers the opens, stats and first reads
+ *   tail   the files are appended to in rounds, each round once the
+ *          last one arrived, the time until every line arrived covers
+ *          the stats and reads that follow changes
+ *
+ * The cpu time narcd used over the whole run is reported as well. Each
+ * run uses the same number of lines, spread over the files.
+ *
+ *   tail_files [-n files[,files...]] [-l lines] [-r rounds] [narcd]
+ *
+ * libuv only uses io_uring from 1.45 on, and only if the kernel lets it
+ * set one up. When either is missing, UV_USE_IO_URING=1 runs on the
+ * threadpool too, which is printed before the results. */
+
+#include <uv.h>		/* Event driven programming library */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <errno.h>	/* system error numbers */
+#include <fcntl.h>	/* file control options */
+#include <poll.h>	/* waiting for input */
+#include <signal.h>	/* signal handling */
+#include <time.h>	/* time types */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <netinet/in.h>	/* internet address family */
+#include <sys/resource.h>	/* resource usage */
+#include <sys/socket.h>	/* sockets */
+#include <sys/syscall.h>	/* raw system calls */
+#include <sys/wait.h>	/* waiting for children */
+
+#define BENCH_DEFAULT_FILES	"1,100,5000"
+#define BENCH_DEFAULT_LINES	100000
+#define BENCH_DEFAULT_ROUNDS	10
+#define BENCH_DEFAULT_NARCD	"../src/narcd"
+#define BENCH_TIMEOUT		60	/* seconds to wait for the lines */
+#define BENCH_LINE_SIZE		100	/* bytes per line, newline included */
+#define BENCH_LINE_FILL		"................................................................................"
+
+typedef struct {
+	double	open;		/* seconds until every file's first line arrived */
+	double	tail;		/* seconds until every appended line arrived */
+	double	cpu;		/* user and system seconds narcd used */
+	long	lines;		/* lines appended while tailing */
+	long	missing;	/* lines that never arrived */
+} bench_result;
+
+/*============================ Utility functions ============================ */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Why UV_USE_IO_URING=1 can't use io_uring here, or NULL if it can. */
+static const char
+*io_uring_missing(void)
+{
+	static char reason[128];
+#ifdef __NR_io_uring_setup
+	char params[120];	/* struct io_uring_params */
+	int fd;
+#endif
+
+	if (uv_version() < 0x012d00) {
+		snprintf(reason, sizeof(reason), "libuv %s has no io_uring support, it came with 1.45",
+			uv_version_string());
+		return reason;
+	}
+#ifdef __NR_io_uring_setup
+	memset(params, 0, sizeof(params));
+	if ((fd = syscall(__NR_io_uring_setup, 1, params)) < 0) {
+		snprintf(reason, sizeof(reason), "the kernel refused io_uring_setup: %s", strerror(errno));
+		return reason;
+	}
+	close(fd);
+	return NULL;
+#else
+	return "io_uring_setup is not a known system call here";
+#endif
+}
+
+/* Read what arrived on the socket within 'timeout' ms, returns the
+ * number of lines. */
+static long
+receive_lines(int sock, int timeout)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	char buf[65536];
+	ssize_t n, i;
+	long lines = 0;
+
+	while (poll(&pfd, 1, timeout) > 0) {
+		if ((n = read(sock, buf, sizeof(buf))) <= 0)
+			break;
+		for (i = 0; i < n; i++)
+			if (buf[i] == '\n')
+				lines++;
+		timeout = 0;
+	}
+	return lines;
+}
+
+/* Wait until 'expected' lines arrived, returns how many are missing. */
+static long
+wait_lines(int sock, long expected, long *received)
+{
+	double deadline = now() + BENCH_TIMEOUT;
+
+	while (*received < expected && now() < deadline)
+		*received += receive_lines(sock, 100);
+
+	return (*received < expected ? expected - *received : 0);
+}
+
+/* One write per call, as a logger flushing its buffer would do. */
+static void
+append_lines(int fd, int file, int first, int count)
+{
+	size_t size = (size_t)count * BENCH_LINE_SIZE, len = 0;
+	char *buf = malloc(size + 1);
+	int i;
+
+	for (i = 0; i < count; i++)
+		len += snprintf(buf + len, size + 1 - len, "data %05d %07d %.*s\n", file, first + i,
+			BENCH_LINE_SIZE - 20, BENCH_LINE_FILL);
+
+	if (write(fd, buf, len) != (ssize_t)len) {
+		perror("write");
+		exit(1);
+	}
+	free(buf);
+}
+
+static pid_t
+start_narcd(const char *narcd, const char *dir, int port, int uring)
+{
+	char conf[256];
+	FILE *fp;
+	pid_t pid;
+
+	snprintf(conf, sizeof(conf), "%s/narc.conf", dir);
+	if ((fp = fopen(conf, "w")) == NULL) {
+		perror(conf);
+		exit(1);
+	}
+	fprintf(fp, "daemonize no\nloglevel warning\nlogfile %s/narc.log\n"
+		"remote-host 127.0.0.1\nremote-port %d\nremote-proto tcp\n"
+		"rate-limit 1000000000\nstream f[%%f] %s/*.log\n", dir, port, dir);
+	fclose(fp);
+
+	if ((pid = fork()) == 0) {
+		setenv("UV_USE_IO_URING", uring ? "1" : "0", 1);
+		execl(narcd, narcd, conf, (char *)NULL);
+		perror(narcd);
+		_exit(1);
+	}
+	return pid;
+}
+
+/*================================== Main =================================== */
+
+static bench_result
+run(const char *narcd, int files, long total, int rounds, int uring)
+{
+	char dir[] = "/tmp/narc-bench-XXXXXX", path[256];
+	int listener, sock, port, i, r, *fds, per_round;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct rusage usage;
+	bench_result result;
+	long received = 0, expected;
+	double start;
+	pid_t pid;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1) {
+		perror("listen");
+		exit(1);
+	}
+	getsockname(listener, (struct sockaddr *)&addr, &addrlen);
+	port = ntohs(addr.sin_port);
+
+	pid = start_narcd(narcd, dir, port, uring);
+	if ((sock = accept(listener, NULL, NULL)) == -1) {
+		perror("accept");
+		exit(1);
+	}
+
+	// files that appear once narcd runs are read from the start
+	fds   = malloc(sizeof(int) * files);
+	start = now();
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/%05d.log", dir, i);
+		if ((fds[i] = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+			perror(path);
+			exit(1);
+		}
+		append_lines(fds[i], i, 0, 1);
+	}
+	result.missing = wait_lines(sock, files, &received);
+	result.open    = now() - start;
+
+	per_round = total / files / rounds;
+	if (per_round < 1)
+		per_round = 1;
+	result.lines = (long)files * rounds * per_round;
+	expected     = received;
+
+	// a round starts once the last one arrived, so that no more than a
+	// change event per file is queued on the inotify descriptor
+	start = now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < files; i++)
+			append_lines(fds[i], i, 1 + r * per_round, per_round);
+		expected += (long)files * per_round;
+		result.missing += wait_lines(sock, expected, &received);
+		received = expected;
+	}
+	result.tail = now() - start;
+
+	kill(pid, SIGTERM);
+	wait4(pid, NULL, 0, &usage);
+	result.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+	for (i = 0; i < files; i++) {
+		close(fds[i]);
+		snprintf(path, sizeof(path), "%s/%05d.log", dir, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/narc.conf", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/narc.log", dir);
+	unlink(path);
+	rmdir(dir);
+
+	free(fds);
+	close(sock);
+	close(listener);
+	return result;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *narcd = BENCH_DEFAULT_NARCD, *missing;
+	char *list = BENCH_DEFAULT_FILES, *copy, *tok;
+	long lines = BENCH_DEFAULT_LINES;
+	int rounds = BENCH_DEFAULT_ROUNDS, files, j, uring, lost = 0;
+	bench_result res;
+
+	for (j = 1; j < argc; j++) {
+		if (!strcmp(argv[j], "-n") && j + 1 < argc) {
+			list = argv[++j];
+		} else if (!strcmp(argv[j], "-l") && j + 1 < argc) {
+			lines = atol(argv[++j]);
+		} else if (!strcmp(argv[j], "-r") && j + 1 < argc) {
+			rounds = atoi(argv[++j]);
+		} else if (argv[j][0] != '-') {
+			narcd = argv[j];
+		} else {
+			fprintf(stderr, "Usage: %s [-n files[,files...]] [-l lines] [-r rounds] [narcd]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (lines < 1 || rounds < 1) {
+		fprintf(stderr, "lines and rounds must be positive\n");
+		return 1;
+	}
+	if (access(narcd, X_OK) == -1) {
+		perror(narcd);
+		return 1;
+	}
+
+	if ((missing = io_uring_missing()) != NULL)
+		printf("io_uring is not used, %s: both columns run on the threadpool\n", missing);
+
+	printf("%-6s %-10s %10s %10s %12s %8s %8s\n",
+		"files", "backend", "open s", "tail s", "lines/s", "cpu s", "missing");
+
+	copy = strdup(list);
+	for (tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if ((files = atoi(tok)) < 1)
+			continue;
+		for (uring = 0; uring <= 1; uring++) {
+			res = run(narcd, files, lines, rounds, uring);
+			printf("%-6d %-10s %10.3f %10.3f %12.0f %8.2f %8ld\n",
+				files, uring ? "io_uring" : "threadpool",
+				res.open, res.tail, res.lines / res.tail, res.cpu, res.missing);
+			lost |= (res.missing > 0);
+			fflush(stdout);
+		}
+	}
+	free(copy);
+
+	if (lost)
+		printf("lines went missing: inotify drops change events once more than\n"
+			"/proc/sys/fs/inotify/max_queued_events are queued\n");
+	return 0;
+}
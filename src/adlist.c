@@ -31,7 +31,7 @@
 
 #include <stdlib.h>
 #include "adlist.h"
-// #include "malloc.h"
+#include "zmalloc.h"
 
 /* Create a new list. The created list can be freed with
  * AlFreeList(), but private value of every node need to be freed
@@ -42,7 +42,7 @@ list *listCreate(void)
 {
     struct list *list;
 
-    if ((list = malloc(sizeof(*list))) == NULL)
+    if ((list = zmalloc(sizeof(*list))) == NULL)
         return NULL;
     list->head = list->tail = NULL;
     list->len = 0;
@@ -65,10 +65,10 @@ void listRelease(list *list)
     while(len--) {
         next = current->next;
         if (list->free) list->free(current->value);
-        free(current);
+        zfree(current);
         current = next;
     }
-    free(list);
+    zfree(list);
 }
 
 /* Add a new node to the list, to head, contaning the specified 'value'
@@ -81,7 +81,7 @@ list *listAddNodeHead(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = zmalloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -107,7 +107,7 @@ list *listAddNodeTail(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = zmalloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -126,7 +126,7 @@ list *listAddNodeTail(list *list, void *value)
 list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = zmalloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (after) {
@@ -157,6 +157,16 @@ list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
  *
  * This function can't fail. */
 void listDelNode(list *list, listNode *node)
+{
+    if (list->free) list->free(node->value);
+    listUnlinkNode(list, node);
+}
+
+/* Remove the specified node from the specified list without freeing
+ * the value it holds. The node itself is freed.
+ *
+ * This function can't fail. */
+void listUnlinkNode(list *list, listNode *node)
 {
     if (node->prev)
         node->prev->next = node->next;
@@ -166,8 +176,7 @@ void listDelNode(list *list, listNode *node)
         node->next->prev = node->prev;
     else
         list->tail = node->prev;
-    if (list->free) list->free(node->value);
-    free(node);
+    zfree(node);
     list->len--;
 }
 
@@ -179,7 +188,7 @@ listIter *listGetIterator(list *list, int direction)
 {
     listIter *iter;
     
-    if ((iter = malloc(sizeof(*iter))) == NULL) return NULL;
+    if ((iter = zmalloc(sizeof(*iter))) == NULL) return NULL;
     if (direction == AL_START_HEAD)
         iter->next = list->head;
     else
@@ -190,7 +199,7 @@ listIter *listGetIterator(list *list, int direction)
 
 /* Release the iterator memory */
 void listReleaseIterator(listIter *iter) {
-    free(iter);
+    zfree(iter);
 }
 
 /* Create an iterator in the list private iterator structure */
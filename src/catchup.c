@@ -0,0 +1,229 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "catchup.h"
+#include "stream.h"
+#include "scheduler.h"
+#include "split.h"
+
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <errno.h>	/* system error numbers */
+#include <setjmp.h>	/* non-local goto */
+#include <signal.h>	/* signal handling */
+#include <string.h>	/* string operations */
+#include <sys/mman.h>	/* memory management declarations */
+#include <sys/stat.h>	/* data returned by the stat() function */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <uv.h>		/* Event driven programming library */
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/* A stream at least mmap-threshold bytes behind, after a restart with a
+ * persisted offset for instance, is read by mapping a window of the
+ * file and splitting the lines straight out of the mapping, instead of
+ * copying them into the read buffers first. The worker maps and
+ * prefaults the window, so the loop does not wait on the disk. Once the
+ * stream is within max-read-size of the end it goes back to reads.
+ *
+ * The mapping is read only, nothing is written to it. A file that is
+ * truncated under a mapping raises SIGBUS on access, so the size is
+ * checked again before the window is split, and the split runs under a
+ * SIGBUS guard in case the file shrinks meanwhile. A SIGBUS abandons the
+ * rest of the window, the stream goes on after the last line it handed
+ * on and is stat'd, which notices the truncation. The handler is only installed while a window is split. */
+
+static sigjmp_buf mmap_jump;
+static struct sigaction mmap_previous;
+static char *mmap_start = NULL, *mmap_end = NULL;
+
+/*============================ Utility functions ============================ */
+
+static void
+release_mmap_read(narc_mmap_read *read)
+{
+	if (read->map != NULL)
+		munmap(read->map, read->map_length);
+	zfree(read);
+}
+
+/* Returns 0 if the file no longer holds the whole window. */
+static int
+window_intact(narc_mmap_read *read)
+{
+	struct stat st;
+
+	if (read->stream->fd != read->fd || fstat(read->fd, &st) == -1)
+		return 0;
+	return (st.st_size >= read->offset + (off_t)read->length);
+}
+
+static void handle_sigbus(int sig, siginfo_t *info, void *context);
+
+/* Split the window into lines under the SIGBUS guard. Returns NARC_ERR
+ * if the file was truncated under it, with the stream offset moved past
+ * the lines handed on before the fault. */
+static int
+split_mapped_window(narc_mmap_read *read)
+{
+	struct sigaction act;
+	int status = NARC_OK;
+
+	sigemptyset(&act.sa_mask);
+	act.sa_flags     = SA_SIGINFO;
+	act.sa_sigaction = handle_sigbus;
+	sigaction(SIGBUS, &act, &mmap_previous);
+
+	mmap_start = read->map;
+	mmap_end   = read->map + read->map_length;
+
+	if (sigsetjmp(mmap_jump, 1) == 0)
+		split_lines(read->stream, read->map + read->delta, read->length);
+	else {
+		// the lines before the fault went out, resume after them
+		read->stream->offset = read->stream->line_start + read->stream->index;
+		status = NARC_ERR;
+	}
+
+	mmap_start = mmap_end = NULL;
+	sigaction(SIGBUS, &mmap_previous, NULL);
+
+	return status;
+}
+
+/*=============================== Callbacks ================================= */
+
+static void
+handle_sigbus(int sig, siginfo_t *info, void *context)
+{
+	char *addr = (char *)info->si_addr;
+
+	if (addr >= mmap_start && addr < mmap_end)
+		siglongjmp(mmap_jump, 1);
+
+	// not ours, the fault repeats under the previous handler
+	sigaction(SIGBUS, &mmap_previous, NULL);
+}
+
+/* Runs on the threadpool. */
+void
+map_file_window(uv_work_t *req)
+{
+	narc_mmap_read *read = req->data;
+	int64_t page = sysconf(_SC_PAGESIZE);
+	int64_t start;
+	struct stat st;
+
+	if (fstat(read->fd, &st) == -1) {
+		read->result = -errno;
+		return;
+	}
+
+	if (st.st_size <= read->offset) {
+		read->result = 0;
+		return;
+	}
+
+	if ((int64_t)read->length > st.st_size - read->offset)
+		read->length = st.st_size - read->offset;
+
+	start            = read->offset & ~(page - 1);
+	read->delta      = read->offset - start;
+	read->map_length = read->length + read->delta;
+
+	read->map = mmap(NULL, read->map_length, PROT_READ,
+		MAP_PRIVATE | MAP_POPULATE, read->fd, start);
+
+	if (read->map == MAP_FAILED) {
+		read->map    = NULL;
+		read->result = -errno;
+		return;
+	}
+
+	madvise(read->map, read->map_length, MADV_SEQUENTIAL);
+	read->result = read->length;
+}
+
+void
+handle_mmap_read(uv_work_t *req, int status)
+{
+	narc_mmap_read *read = req->data;
+	narc_stream *stream = read->stream;
+	ssize_t result = read->result;
+	int truncated = 0;
+
+	finish_scheduled_read(stream, result);
+
+	if (finish_stream_request(stream)) {
+		release_mmap_read(read);
+		return;
+	}
+
+	if (result < 0)
+		narc_log(NARC_WARNING, "mmap error (%s): %s", stream->file, strerror(-result));
+
+	if (result > 0) {
+		if (window_intact(read) && split_mapped_window(read) == NARC_OK)
+			stream->offset += result;
+		else {
+			narc_log(NARC_WARNING, "%s shrank while it was mapped", stream->file);
+			truncated = 1;
+			result = 0;
+		}
+	}
+
+	release_mmap_read(read);
+	finish_file_read(stream, result);
+
+	if (truncated)
+		start_file_stat(stream);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_mmap_read(narc_stream *stream)
+{
+	narc_mmap_read *read = zmalloc(sizeof(narc_mmap_read));
+
+	read->stream   = stream;
+	read->fd       = stream->fd;
+	read->offset   = stream->offset;
+	read->length   = stream->read_size;
+	read->map      = NULL;
+	read->result   = 0;
+	read->req.data = (void *)read;
+
+	if (uv_queue_work(server.loop, &read->req, map_file_window, handle_mmap_read) == 0) {
+		lock_stream(stream);
+		stream->requests++;
+	} else
+		zfree(read);
+}
+
+/*================================== API ==================================== */
+
+/* Whether the next read of the stream maps the file. A stream switches
+ * to mapping at mmap-threshold bytes behind and back to reads near the
+ * end, as far as the last stat knows. */
+int
+use_mmap_read(narc_stream *stream)
+{
+	int64_t behind = stream->size - stream->offset;
+
+	if (server.mmap_threshold == 0 || stream->drain)
+		return 0;
+
+	if (!stream->mmap && behind >= server.mmap_threshold) {
+		narc_log(NARC_NOTICE, "%s is %lld bytes behind, mapping it to catch up",
+			stream->file, (long long)behind);
+		stream->mmap = 1;
+	} else if (stream->mmap && behind < server.max_read_size) {
+		narc_log(NARC_NOTICE, "%s caught up, back to reads", stream->file);
+		stream->mmap = 0;
+	}
+
+	return stream->mmap;
+}
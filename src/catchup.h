@@ -0,0 +1,39 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_CATCHUP
+#define NARC_CATCHUP
+
+#include "narc.h"
+#include "stream.h"
+
+#include <uv.h>		/* Event driven programming library */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* One window of a file mapped by a threadpool worker, and split into
+ * lines in place on the loop once it comes back. */
+typedef struct {
+	uv_work_t	req;
+	narc_stream	*stream;
+	uv_file		fd;		/* file the window belongs to */
+	int64_t		offset;		/* stream offset of the window */
+	size_t		length;		/* bytes asked for, then bytes mapped */
+	char		*map;		/* mapping, NULL if nothing was mapped */
+	size_t		map_length;	/* bytes mapped, from a page boundary */
+	size_t		delta;		/* where the window starts in the mapping */
+	ssize_t		result;		/* bytes in the window, 0 at EOF, or -errno */
+} narc_mmap_read;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_mmap_read(narc_stream *stream);
+
+/* api */
+int	use_mmap_read(narc_stream *stream);
+
+#endif
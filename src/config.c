@@ -4,9 +4,13 @@
 #include "config.h"
 #include "narc.h"
 #include "stream.h"
+#include "discovery.h"
+#include "scheduler.h"
+#include "registry.h"
+#include "util.h"	/* Misc functions useful in many places */
 
 #include "sds.h"	/* dynamic safe strings */
-// #include "malloc.h"	/* total memory usage aware version of malloc/free */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
 
 #include <stdio.h>	/* standard buffered input/output */
 #include <stdlib.h>	/* standard library definitions */
@@ -61,6 +65,106 @@ yesnotoi(char *s)
 	else return -1;
 }
 
+int
+watchtoi(char *s)
+{
+	if (!strcasecmp(s,"auto")) return NARC_WATCH_AUTO;
+	else if (!strcasecmp(s,"inotify")) return NARC_WATCH_INOTIFY;
+	else if (!strcasecmp(s,"poll")) return NARC_WATCH_POLL;
+	else return -1;
+}
+
+regex_t
+*compile_regex(char *pattern)
+{
+	regex_t *re = zmalloc(sizeof(regex_t));
+
+	if (regcomp(re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+		zfree(re);
+		return NULL;
+	}
+	return re;
+}
+
+/* Parse the '<option> <value>' pairs following 'stream <id> <file>'.
+ * Returns NULL with 'err' set on a bad option. */
+narc_stream_opts
+*load_stream_opts(sds *argv, int argc, char **err)
+{
+	narc_stream_opts *opts = new_stream_opts();
+	regex_t **re;
+	int j;
+
+	for (j = 0; j + 1 < argc; j += 2) {
+		if (!strcasecmp(argv[j],"multiline-start") || !strcasecmp(argv[j],"multiline-continue")) {
+			re = !strcasecmp(argv[j],"multiline-start") ? &opts->multiline_start : &opts->multiline_continue;
+			if (*re != NULL) {
+				regfree(*re);
+				zfree(*re);
+			}
+			if ((*re = compile_regex(argv[j+1])) == NULL) {
+				*err = "Invalid multiline regular expression"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"multiline-max-lines")) {
+			opts->multiline_max_lines = atoi(argv[j+1]);
+			if (opts->multiline_max_lines < 1) {
+				*err = "Invalid multiline-max-lines"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"multiline-max-bytes")) {
+			opts->multiline_max_bytes = memtoll(argv[j+1], NULL);
+			if (opts->multiline_max_bytes < 1) {
+				*err = "Invalid multiline-max-bytes"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"multiline-timeout")) {
+			opts->multiline_timeout = atoll(argv[j+1]);
+		} else if (!strcasecmp(argv[j],"max-message-size")) {
+			long long size = memtoll(argv[j+1], NULL);
+			if (size < 1 || size > NARC_MAX_MESSAGE_SIZE) {
+				*err = "Invalid max-message-size, must be between 1 and 65507 bytes"; goto opterr;
+			}
+			opts->max_message_size = size;
+		} else if (!strcasecmp(argv[j],"dedup-window")) {
+			opts->dedup_window = atoi(argv[j+1]);
+			if (opts->dedup_window < 0) {
+				*err = "Invalid dedup-window"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"dedup-flush")) {
+			opts->dedup_flush = atoll(argv[j+1]);
+			if (opts->dedup_flush == 0) {
+				*err = "Invalid dedup-flush"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"dedup-templates")) {
+			if ((opts->dedup_templates = yesnotoi(argv[j+1])) == -1) {
+				*err = "argument must be 'yes' or 'no'"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"weight")) {
+			opts->weight = atoi(argv[j+1]);
+			if (opts->weight < 1 || opts->weight > NARC_SCHED_MAX_WEIGHT) {
+				*err = "Invalid weight, must be between 1 and 16"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"watch")) {
+			if ((opts->watch = watchtoi(argv[j+1])) == -1) {
+				*err = "Invalid watch, must be auto, inotify or poll"; goto opterr;
+			}
+		} else if (!strcasecmp(argv[j],"split-long-lines")) {
+			if ((opts->split_long_lines = yesnotoi(argv[j+1])) == -1) {
+				*err = "argument must be 'yes' or 'no'"; goto opterr;
+			}
+		} else {
+			*err = "Unknown stream option"; goto opterr;
+		}
+	}
+
+	if (opts->multiline_start != NULL && opts->multiline_continue != NULL) {
+		*err = "Only one of multiline-start and multiline-continue can be set"; goto opterr;
+	}
+	return opts;
+
+opterr:
+	free_stream_opts(opts);
+	return NULL;
+}
+
 void
 load_server_config_from_string(char *config)
 {
@@ -100,8 +204,8 @@ load_server_config_from_string(char *config)
 				err = "argument must be 'yes' or 'no'"; goto loaderr;
 			}
 		} else if (!strcasecmp(argv[0], "pidfile") && argc == 2) {
-			free(server.pidfile);
-			server.pidfile = strdup(argv[1]);
+			zfree(server.pidfile);
+			server.pidfile = zstrdup(argv[1]);
 		} else if (!strcasecmp(argv[0], "loglevel") && argc == 2) {
 			if (!strcasecmp(argv[1],"debug")) server.verbosity = NARC_DEBUG;
 			else if (!strcasecmp(argv[1],"verbose")) server.verbosity = NARC_VERBOSE;
@@ -114,8 +218,8 @@ load_server_config_from_string(char *config)
 		} else if (!strcasecmp(argv[0],"logfile") && argc == 2) {
 			FILE *logfp;
 
-			free(server.logfile);
-			server.logfile = strdup(argv[1]);
+			zfree(server.logfile);
+			server.logfile = zstrdup(argv[1]);
 			if (server.logfile[0] != '\0') {
 				/* Test if we are able to open the file. The server will not
 				* be able to abort just for this problem later... */
@@ -132,8 +236,8 @@ load_server_config_from_string(char *config)
 				err = "argument must be 'yes' or 'no'"; goto loaderr;
 			}
 		} else if (!strcasecmp(argv[0],"syslog-ident") && argc == 2) {
-			if (server.syslog_ident) free(server.syslog_ident);
-				server.syslog_ident = strdup(argv[1]);
+			if (server.syslog_ident) zfree(server.syslog_ident);
+				server.syslog_ident = zstrdup(argv[1]);
 		} else if (!strcasecmp(argv[0],"syslog-facility") && argc == 2) {
 			int i;
 
@@ -149,8 +253,8 @@ load_server_config_from_string(char *config)
 				goto loaderr;
 			}
 		} else if (!strcasecmp(argv[0], "remote-host") && argc == 2) {
-			free(server.host);
-			server.host = strdup(argv[1]);
+			zfree(server.host);
+			server.host = zstrdup(argv[1]);
 		} else if (!strcasecmp(argv[0], "remote-port") && argc == 2) {
 			server.port = atoi(argv[1]);
 			if (server.port < 0 || server.port > 65535) {
@@ -167,13 +271,57 @@ load_server_config_from_string(char *config)
 			server.max_connect_attempts = atoi(argv[1]);
 		} else if (!strcasecmp(argv[0], "connect-retry-delay") && argc == 2) {
 			server.connect_retry_delay = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0], "tcp-batch-bytes") && argc == 2) {
+			server.tcp_batch_bytes = atoi(argv[1]);
+			if (server.tcp_batch_bytes < 1) {
+				err = "Invalid tcp-batch-bytes"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "tcp-flush-interval") && argc == 2) {
+			if (atoll(argv[1]) < 0) {
+				err = "Invalid tcp-flush-interval"; goto loaderr;
+			}
+			server.tcp_flush_interval = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0], "tcp-high-water") && argc == 2) {
+			server.tcp_high_water = memtoll(argv[1], NULL);
+		} else if (!strcasecmp(argv[0], "tcp-low-water") && argc == 2) {
+			server.tcp_low_water = memtoll(argv[1], NULL);
+		} else if (!strcasecmp(argv[0], "tcp-queue-limit") && argc == 2) {
+			server.tcp_queue_limit = memtoll(argv[1], NULL);
+		} else if (!strcasecmp(argv[0], "spool-dir") && argc == 2) {
+			zfree(server.spool_dir);
+			server.spool_dir = zstrdup(argv[1]);
+		} else if (!strcasecmp(argv[0], "spool-max-size") && argc == 2) {
+			int memerr;
+			server.spool_max_size = memtoll(argv[1], &memerr);
+			if (memerr || server.spool_max_size <= 0) {
+				err = "Invalid spool max size"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "spool-segment-size") && argc == 2) {
+			int memerr;
+			server.spool_segment_size = memtoll(argv[1], &memerr);
+			if (memerr || server.spool_segment_size <= 0) {
+				err = "Invalid spool segment size"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "spool-replay-rate") && argc == 2) {
+			server.spool_replay_rate = atoi(argv[1]);
+			if (server.spool_replay_rate < 1) {
+				err = "Invalid spool-replay-rate"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "spool-sync-interval") && argc == 2) {
+			// a repeat of 0 would leave the sync timer firing once
+			if (atoll(argv[1]) < 1) {
+				err = "Invalid spool-sync-interval"; goto loaderr;
+			}
+			server.spool_sync_interval = atoll(argv[1]);
 		} else if (!strcasecmp(argv[0], "max-open-attempts") && argc == 2) {
 			server.max_open_attempts = atoi(argv[1]);
 		} else if (!strcasecmp(argv[0], "open-retry-delay") && argc == 2) {
 			server.open_retry_delay = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0], "rotate-grace-period") && argc == 2) {
+			server.rotate_grace_period = atoll(argv[1]);
 		} else if (!strcasecmp(argv[0], "stream-id") && argc == 2) {
-			free(server.stream_id);
-			server.stream_id = strdup(argv[1]);
+			zfree(server.stream_id);
+			server.stream_id = zstrdup(argv[1]);
 		} else if (!strcasecmp(argv[0], "stream-facility") && argc == 2) {
 			int i;
 
@@ -202,15 +350,100 @@ load_server_config_from_string(char *config)
 				err = "Invalid stream priority. Must be one of: 'emergency', 'alert', 'critical', 'error', 'warning', 'info', 'notice', or 'debug'";
 				goto loaderr;
 			}
-		} else if (!strcasecmp(argv[0],"stream") && argc == 3) {
-			char *id = sdsdup(argv[1]);
-			char *file = sdsdup(argv[2]);
-			narc_stream *stream = new_stream(id, file);
-			listAddNodeTail(server.streams, (void *)stream);
+		} else if (!strcasecmp(argv[0],"stream") && argc >= 3 && argc % 2 == 1) {
+			narc_stream_opts *opts = NULL;
+			if (argc > 3 && (opts = load_stream_opts(&argv[3], argc - 3, &err)) == NULL)
+				goto loaderr;
+			if (is_glob_pattern(argv[2])) {
+				narc_glob *glob = new_glob(sdsdup(argv[1]), sdsdup(argv[2]));
+				if (glob == NULL) {
+					err = "Wildcards are only supported in the file name of a stream";
+					goto loaderr;
+				}
+				if (opts != NULL)
+					glob->opts = opts;
+				listAddNodeTail(server.globs, (void *)glob);
+			} else {
+				char *id = sdsdup(argv[1]);
+				char *file = sdsdup(argv[2]);
+				narc_stream *stream = new_stream(id, file);
+				if (opts != NULL)
+					stream->opts = opts;
+				register_stream(stream);
+			}
 		} else if (!strcasecmp(argv[0],"rate-limit") && argc == 2) {
 			server.rate_limit = atoi(argv[1]);
 		} else if (!strcasecmp(argv[0],"rate-time") && argc == 2) {
 			server.rate_time = atoi(argv[1]);
+		} else if (!strcasecmp(argv[0],"offset-registry") && argc == 2) {
+			zfree(server.offset_registry);
+			server.offset_registry = zstrdup(argv[1]);
+		} else if (!strcasecmp(argv[0],"offset-checkpoint-interval") && argc == 2) {
+			server.offset_checkpoint_interval = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0],"max-message-size") && argc == 2) {
+			long long size = memtoll(argv[1], NULL);
+			if (size < 1 || size > NARC_MAX_MESSAGE_SIZE) {
+				err = "Invalid max-message-size, must be between 1 and 65507 bytes"; goto loaderr;
+			}
+			server.max_message_size = size;
+		} else if (!strcasecmp(argv[0],"max-read-size") && argc == 2) {
+			server.max_read_size = memtoll(argv[1], NULL);
+			if (server.max_read_size < NARC_MAX_BUFF_SIZE
+			    || server.max_read_size > NARC_STREAM_BUFFERS * NARC_STREAM_CHUNK) {
+				err = "Invalid max-read-size, must be between 4kb and 1mb"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"io-backend") && argc == 2) {
+			if (!strcasecmp(argv[1],"auto")) {
+				server.io_backend = NARC_IO_AUTO;
+			} else if (!strcasecmp(argv[1],"io_uring")) {
+				server.io_backend = NARC_IO_URING;
+			} else if (!strcasecmp(argv[1],"threadpool")) {
+				server.io_backend = NARC_IO_THREADPOOL;
+			} else {
+				err = "Invalid io-backend, must be auto, io_uring or threadpool"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"watch") && argc == 2) {
+			if ((server.watch = watchtoi(argv[1])) == -1) {
+				err = "Invalid watch, must be auto, inotify or poll"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"poll-min-interval") && argc == 2) {
+			server.poll_min_interval = atoll(argv[1]);
+			if (server.poll_min_interval == 0) {
+				err = "Invalid poll-min-interval"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"poll-max-interval") && argc == 2) {
+			server.poll_max_interval = atoll(argv[1]);
+			if (server.poll_max_interval == 0) {
+				err = "Invalid poll-max-interval"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"hibernate-after") && argc == 2) {
+			server.hibernate_after = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0],"max-open-files") && argc == 2) {
+			server.max_open_files = atoi(argv[1]);
+			if (server.max_open_files < 0) {
+				err = "Invalid max-open-files"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"mmap-threshold") && argc == 2) {
+			server.mmap_threshold = memtoll(argv[1], NULL);
+		} else if (!strcasecmp(argv[0],"change-debounce") && argc == 2) {
+			server.change_debounce = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0],"fast-read-max") && argc == 2) {
+			server.fast_read_max = memtoll(argv[1], NULL);
+		} else if (!strcasecmp(argv[0],"read-budget") && argc == 2) {
+			server.read_budget = memtoll(argv[1], NULL);
+			if (server.read_budget < NARC_MAX_BUFF_SIZE) {
+				err = "Invalid read-budget, must be at least 4kb"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
+			server.maxmemory = memtoll(argv[1], NULL);
+		} else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
+			if (!strcasecmp(argv[1],"drop")) {
+				server.maxmemory_policy = NARC_MAXMEMORY_DROP;
+			} else if (!strcasecmp(argv[1],"pause")) {
+				server.maxmemory_policy = NARC_MAXMEMORY_PAUSE;
+			} else {
+				err = "Invalid maxmemory-policy, must be drop or pause"; goto loaderr;
+			}
 		} else if (!strcasecmp(argv[0],"truncate-limit") && argc == 2) {
 			server.truncate_limit = atoi(argv[1]);
 		} else {
@@ -220,8 +453,18 @@ load_server_config_from_string(char *config)
 	}
 	sdsfreesplitres(lines,totlines);
 
+	// settings that depend on each other, whatever order they came in
+	if (server.spool_segment_size > server.spool_max_size) {
+		err = "spool-segment-size can't be larger than spool-max-size"; goto checkerr;
+	}
+
 	return;
 
+checkerr:
+	fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+	fprintf(stderr, "%s\n", err);
+	exit(1);
+
 loaderr:
 	fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
 	fprintf(stderr, "Reading the configuration file, at line %d\n", linenum);
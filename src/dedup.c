@@ -0,0 +1,256 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "dedup.h"
+#include "stream.h"
+#include "crc64.h"
+#include "pool.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <uv.h>		/* Event driven programming library */
+
+/* Lines are hashed into a small table per stream instead of only being
+ * compared to the previous one, so interleaved storms (A, B, A, B, ...)
+ * are collapsed too. A line found in the table is counted rather than
+ * forwarded. The counts are reported when the entry is evicted, every
+ * NARC_DEDUP_SUMMARY_EVERY repeats and every dedup-flush ms, and entries
+ * that did not come back during a flush period expire.
+ *
+ * With dedup-templates the table is keyed by the line's template, where
+ * numbers, hex ids and UUIDs are masked. The first line of a template is
+ * forwarded as an exemplar, the ones that follow are only counted. */
+
+/*============================ Utility functions ============================ */
+
+static int
+is_hex(char c)
+{
+	return ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
+}
+
+static int
+is_word(char c)
+{
+	return (is_hex(c) || (c >= 'g' && c <= 'z') || (c >= 'G' && c <= 'Z') || c == '_');
+}
+
+/* Length of the UUID (8-4-4-4-12 hex digits) at 'p', or 0. */
+static int
+uuid_length(const char *p, const char *end)
+{
+	static const int groups[] = {8, 4, 4, 4, 12};
+	const char *q = p;
+	int g, i;
+
+	for (g = 0; g < 5; g++) {
+		if (g > 0 && (q >= end || *q++ != '-'))
+			return 0;
+		for (i = 0; i < groups[g]; i++, q++)
+			if (q >= end || !is_hex(*q))
+				return 0;
+	}
+	return (q < end && is_word(*q)) ? 0 : q - p;
+}
+
+/* Copy the line to the template buffer with every variable token replaced
+ * by NARC_DEDUP_MASK: UUIDs, 0x prefixed numbers, runs of at least
+ * NARC_DEDUP_MIN_HEX hex digits that contain a decimal digit, and any
+ * other run of decimal digits. */
+sds
+mask_line(sds template, const char *line, int len)
+{
+	const char *p = line, *end = line + len, *q;
+	char mask = NARC_DEDUP_MASK;
+	int digits, n;
+
+	sdsclear(template);
+
+	while (p < end) {
+		q = p;
+
+		// hex tokens only count at the start of a word
+		if (is_hex(*p) && (p == line || !is_word(p[-1]))) {
+			if ((n = uuid_length(p, end)) > 0) {
+				q = p + n;
+			} else if (*p == '0' && p + 2 < end && (p[1] == 'x' || p[1] == 'X') && is_hex(p[2])) {
+				for (q = p + 2; q < end && is_hex(*q); q++);
+			} else {
+				for (digits = 0; q < end && is_hex(*q); q++)
+					digits |= (*q >= '0' && *q <= '9');
+				if (!digits || q - p < NARC_DEDUP_MIN_HEX || (q < end && is_word(*q)))
+					q = p;
+			}
+		}
+
+		if (q == p)
+			for (; q < end && *q >= '0' && *q <= '9'; q++);
+
+		if (q > p) {
+			template = sdscatlen(template, &mask, 1);
+			p = q;
+		} else {
+			template = sdscatlen(template, p++, 1);
+		}
+	}
+	return template;
+}
+
+void
+report_dedup_entry(narc_stream *stream, narc_dedup_entry *entry)
+{
+	narc_dedup *dedup = (narc_dedup *)stream->dedup;
+	sds msg;
+
+	if (entry->count == 0)
+		return;
+
+	if (dedup->templates) {
+		msg = sdscatprintf(sdsempty(), "Suppressed %d similar messages: ", entry->count);
+		msg = sdscatsds(msg, entry->line);
+		submit_message(stream, msg, sdslen(msg));
+		sdsfree(msg);
+	} else if (entry->count == 1) {
+		submit_message(stream, entry->line, sdslen(entry->line));
+	} else {
+		msg = sdscatprintf(sdsempty(), "Message repeated %d times: ", entry->count);
+		msg = sdscatsds(msg, entry->line);
+		submit_message(stream, msg, sdslen(msg));
+		sdsfree(msg);
+	}
+	entry->count = 0;
+}
+
+void
+clear_dedup_entry(narc_dedup_entry *entry)
+{
+	sdsfree(entry->line);
+	entry->line  = NULL;
+	entry->count = 0;
+	entry->seen  = 0;
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_dedup_flush(uv_timer_t *timer)
+{
+	flush_dedup((narc_stream *)timer->data, 1);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_dedup_timer(narc_stream *stream)
+{
+	narc_dedup *dedup = (narc_dedup *)stream->dedup;
+	uint64_t interval = stream->opts->dedup_flush;
+
+	dedup->flush_timer = pool_alloc(&timer_pool);
+	uv_timer_init(server.loop, dedup->flush_timer);
+	dedup->flush_timer->data = (void *)stream;
+	uv_timer_start(dedup->flush_timer, handle_dedup_flush, interval, interval);
+}
+
+/*================================== API ==================================== */
+
+narc_dedup
+*new_dedup(int size, int templates)
+{
+	narc_dedup *dedup = zmalloc(sizeof(narc_dedup));
+
+	dedup->entries     = zcalloc(size, sizeof(narc_dedup_entry));
+	dedup->size        = size;
+	dedup->templates   = templates;
+	dedup->template    = sdsempty();
+	dedup->flush_timer = NULL;
+
+	return dedup;
+}
+
+void
+stop_dedup(narc_dedup *dedup)
+{
+	if (dedup->flush_timer != NULL) {
+		close_pooled_timer(dedup->flush_timer);
+		dedup->flush_timer = NULL;
+	}
+}
+
+void
+free_dedup(narc_dedup *dedup)
+{
+	int i;
+
+	stop_dedup(dedup);
+	for (i = 0; i < dedup->size; i++)
+		sdsfree(dedup->entries[i].line);
+	zfree(dedup->entries);
+	sdsfree(dedup->template);
+	zfree(dedup);
+}
+
+/* Returns 1 if the line was seen within the window and is only counted,
+ * 0 if the caller should forward it. */
+int
+dedup_line(narc_stream *stream, char *line, int len)
+{
+	narc_dedup *dedup = (narc_dedup *)stream->dedup;
+	narc_dedup_entry *entry;
+	uint64_t hash;
+
+	if (dedup->templates) {
+		dedup->template = mask_line(dedup->template, line, len);
+		line = dedup->template;
+		len  = sdslen(dedup->template);
+	}
+
+	hash  = crc64(0, (unsigned char *)line, len);
+	entry = &dedup->entries[hash % dedup->size];
+
+	if (entry->line != NULL && entry->hash == hash
+	    && sdslen(entry->line) == (size_t)len && memcmp(entry->line, line, len) == 0) {
+		entry->seen = 1;
+		if (++entry->count % NARC_DEDUP_SUMMARY_EVERY == 0)
+			report_dedup_entry(stream, entry);
+		return 1;
+	}
+
+	if (entry->line != NULL) {
+		report_dedup_entry(stream, entry);
+		entry->line = sdscpylen(entry->line, line, len);
+	} else {
+		entry->line = sdsnewlen(line, len);
+	}
+	entry->hash  = hash;
+	entry->count = 0;
+	entry->seen  = 1;
+
+	return 0;
+}
+
+/* Report every pending count. With 'expire' set, lines that did not show
+ * up since the previous flush are dropped from the window. */
+void
+flush_dedup(narc_stream *stream, int expire)
+{
+	narc_dedup *dedup = (narc_dedup *)stream->dedup;
+	narc_dedup_entry *entry;
+	int i;
+
+	for (i = 0; i < dedup->size; i++) {
+		entry = &dedup->entries[i];
+		if (entry->line == NULL)
+			continue;
+
+		report_dedup_entry(stream, entry);
+		if (expire && !entry->seen)
+			clear_dedup_entry(entry);
+		else
+			entry->seen = 0;
+	}
+}
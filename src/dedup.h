@@ -0,0 +1,56 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_DEDUP
+#define NARC_DEDUP
+
+#include "narc.h"
+#include "stream.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* Static dedup configuration */
+#define NARC_DEDUP_SUMMARY_EVERY	500	/* summarize a storm every this many repeats */
+#define NARC_DEDUP_TEMPLATE_WINDOW	64	/* window used by dedup-templates without dedup-window */
+#define NARC_DEDUP_MASK			'*'	/* replaces variable tokens in templates */
+#define NARC_DEDUP_MIN_HEX		8	/* shorter hex runs are left alone */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* A line seen recently, and how often it came back since it was last
+ * forwarded or summarized. */
+typedef struct {
+	uint64_t	hash;		/* crc64 of the line */
+	sds		line;		/* the line or its template, NULL for a free slot */
+	int		count;		/* repeats not yet reported */
+	int		seen;		/* seen since the last flush */
+} narc_dedup_entry;
+
+/* Direct mapped table of the last lines of a stream, indexed by hash. A
+ * line evicts whatever was in its slot, so the window holds up to 'size'
+ * distinct lines. */
+typedef struct {
+	narc_dedup_entry	*entries;	/* 'size' slots */
+	int			size;		/* number of slots */
+	int			templates;	/* group lines by template rather than exact match */
+	sds			template;	/* scratch buffer for masking lines */
+	uv_timer_t		*flush_timer;	/* reports and expires entries every dedup-flush ms */
+} narc_dedup;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_dedup_timer(narc_stream *stream);
+
+/* api */
+narc_dedup	*new_dedup(int size, int templates);
+void		free_dedup(narc_dedup *dedup);
+void		stop_dedup(narc_dedup *dedup);
+int		dedup_line(narc_stream *stream, char *line, int len);
+void		flush_dedup(narc_stream *stream, int expire);
+
+#endif
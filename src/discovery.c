@@ -0,0 +1,409 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "discovery.h"
+#include "stream.h"
+#include "hibernate.h"
+#include "registry.h"
+#include "pool.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <glob.h>	/* pathname pattern matching */
+#include <fnmatch.h>	/* file name matching */
+#include <sys/stat.h>	/* file status */
+#include <uv.h>		/* Event driven programming library */
+
+/*============================ Utility functions ============================ */
+
+int
+regular_file_exists(char *path)
+{
+	struct stat st;
+	return (stat(path, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+/* Build a stream id from the glob's id template, '%f' is replaced by the
+ * name of the matched file. */
+sds
+glob_stream_id(narc_glob *glob, const char *name)
+{
+	sds id = sdsempty();
+	char *p = glob->id, *f;
+
+	while ((f = strstr(p, "%f")) != NULL) {
+		id = sdscatlen(id, p, f - p);
+		id = sdscat(id, name);
+		p = f + 2;
+	}
+	return sdscat(id, p);
+}
+
+/* Create a stream for a file matched by a glob. Files found when narc
+ * starts are tailed from the end like any configured stream, files that
+ * show up later are new and read from the start. */
+narc_stream
+*add_glob_stream(narc_glob *glob, char *path, const char *name, int from_start)
+{
+	narc_stream *stream = new_stream(glob_stream_id(glob, name), sdsnew(path));
+
+	stream->glob = glob;
+	stream->opts = glob->opts;
+	if (from_start)
+		stream->size = 0;
+
+	register_stream(stream);
+	return stream;
+}
+
+/* The directory part of a path. */
+sds
+dir_name(char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (slash == NULL)
+		return sdsnew(".");
+	else if (slash == path)
+		return sdsnew("/");
+	return sdsnewlen(path, slash - path);
+}
+
+narc_dir_watch
+*find_dir_watch(char *dir)
+{
+	listIter *iter;
+	listNode *node;
+	narc_dir_watch *watch = NULL;
+
+	iter = listGetIterator(server.dir_watches, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		if (!strcmp(((narc_dir_watch *)listNodeValue(node))->dir, dir)) {
+			watch = (narc_dir_watch *)listNodeValue(node);
+			break;
+		}
+	}
+	listReleaseIterator(iter);
+
+	return watch;
+}
+
+narc_dir_watch
+*new_dir_watch(char *dir)
+{
+	narc_dir_watch *watch = (narc_dir_watch *)zmalloc(sizeof(narc_dir_watch));
+
+	watch->dir       = sdsnew(dir);
+	watch->globs     = listCreate();
+	watch->fs_events = NULL;
+	watch->sleepers  = 0;
+
+	return watch;
+}
+
+void
+free_dir_watch(void *ptr)
+{
+	narc_dir_watch *watch = (narc_dir_watch *)ptr;
+
+	if (watch->fs_events != NULL)
+		uv_close((uv_handle_t *)watch->fs_events, (uv_close_cb)zfree);
+	listRelease(watch->globs);
+	sdsfree(watch->dir);
+	zfree(watch);
+}
+
+/* Create streams for every file the glob matches right now. */
+void
+expand_glob(narc_glob *stream_glob)
+{
+	glob_t matches;
+	size_t i;
+	char *name;
+
+	if (glob(stream_glob->pattern, 0, NULL, &matches) != 0)
+		return;
+
+	for (i = 0; i < matches.gl_pathc; i++) {
+		if (!regular_file_exists(matches.gl_pathv[i]) || find_stream(matches.gl_pathv[i]) != NULL)
+			continue;
+		name = strrchr(matches.gl_pathv[i], '/');
+		add_glob_stream(stream_glob, matches.gl_pathv[i], name ? name + 1 : matches.gl_pathv[i], 0);
+	}
+	globfree(&matches);
+}
+
+/* The file of a glob stream was renamed to a name the glob matches too,
+ * app.log to app-1.log under app*.log for instance. The stream follows
+ * the file, so it isn't read again from the start under its new name. A
+ * drain started when the old name went away is called off. */
+static void
+rebind_stream(narc_stream *stream, char *path)
+{
+	narc_log(NARC_NOTICE, "%s renamed to %s", stream->file, path);
+	rename_stream(stream, sdsnew(path));
+
+	if (stream->open_timer != NULL) {
+		close_pooled_timer(stream->open_timer);
+		stream->open_timer = NULL;
+	}
+	if (stream->drain_timer != NULL) {
+		close_pooled_timer(stream->drain_timer);
+		stream->drain_timer = NULL;
+	}
+	if (stream->next_fd >= 0) {
+		uv_fs_t close_req;
+		uv_fs_close(server.loop, &close_req, stream->next_fd, NULL);
+		uv_fs_req_cleanup(&close_req);
+		stream->next_fd = -1;
+	}
+
+	if (stream->drain) {
+		stream->drain = 0;
+		if (stream->fd >= 0) {
+			start_file_watcher(stream);
+			start_file_read(stream);
+		}
+	}
+}
+
+/* A file showed up in a watched directory. */
+static void
+discover_file(narc_dir_watch *watch, char *path, const char *filename)
+{
+	narc_stream *moved = NULL;
+	narc_glob *glob;
+	listIter *iter;
+	listNode *node;
+	struct stat st;
+
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	moved = find_stream_by_inode(st.st_dev, st.st_ino);
+
+	iter = listGetIterator(watch->globs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		glob = (narc_glob *)listNodeValue(node);
+		if (fnmatch(glob->name, filename, FNM_PERIOD) != 0)
+			continue;
+
+		if (moved == NULL) {
+			narc_log(NARC_NOTICE, "Discovered %s", path);
+			init_stream(add_glob_stream(glob, path, filename, 1));
+		} else if (moved->glob == glob && !moved->retired && !same_file(moved)) {
+			rebind_stream(moved, path);
+		} else {
+			// another name for a file some stream reads already
+			narc_log(NARC_NOTICE, "Discovered %s, tailing it", path);
+			init_stream(add_glob_stream(glob, path, filename, 0));
+		}
+		break;
+	}
+	listReleaseIterator(iter);
+}
+
+/* A hibernating glob stream's file went away. It may only have been
+ * renamed, the stream is retired once the grace period is over if it
+ * wasn't rebound by then. */
+static void
+handle_vanished_timeout(uv_timer_t *timer)
+{
+	narc_stream *stream = (narc_stream *)timer->data;
+
+	close_pooled_timer(stream->drain_timer);
+	stream->drain_timer = NULL;
+
+	if (!regular_file_exists(stream->file))
+		retire_stream(stream);
+}
+
+void
+handle_dir_change(uv_fs_event_t *handle, const char *filename, int events, int status)
+{
+	narc_dir_watch *watch = handle->data;
+	narc_stream *stream;
+	sds path;
+
+	if (status < 0 || filename == NULL)
+		return;
+
+	path   = sdscatprintf(sdsempty(), "%s/%s", watch->dir, filename);
+	stream = find_stream(path);
+
+	if (stream != NULL) {
+		// read what is left of the file first, the stream is retired
+		// if nothing takes its place before the drain is over
+		if (stream->glob != NULL && !regular_file_exists(path) && !stream->drain) {
+			if (stream->fd >= 0)
+				start_file_drain(stream);
+			else if (stream->drain_timer == NULL)
+				start_vanished_timer(stream);
+		} else if (stream->hibernating & NARC_STREAM_DIR_WATCH)
+			wake_stream(stream);
+	} else
+		discover_file(watch, path, filename);
+
+	sdsfree(path);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_vanished_timer(narc_stream *stream)
+{
+	stream->drain_timer = pool_alloc(&timer_pool);
+	if (uv_timer_init(server.loop, stream->drain_timer) == 0) {
+		if (uv_timer_start(stream->drain_timer, handle_vanished_timeout, server.rotate_grace_period, 0) == 0)
+			stream->drain_timer->data = (void *)stream;
+	}
+}
+
+void
+start_dir_watcher(narc_dir_watch *watch)
+{
+	watch->fs_events = zmalloc(sizeof(uv_fs_event_t));
+	uv_fs_event_init(server.loop, watch->fs_events);
+	if (uv_fs_event_start(watch->fs_events, handle_dir_change, watch->dir, 0) == 0) {
+		watch->fs_events->data = (void *)watch;
+	} else {
+		narc_log(NARC_WARNING, "Can't watch directory %s", watch->dir);
+		uv_close((uv_handle_t *)watch->fs_events, (uv_close_cb)zfree);
+		watch->fs_events = NULL;
+	}
+}
+
+/*================================== API ==================================== */
+
+int
+is_glob_pattern(char *file)
+{
+	return (strpbrk(file, "*?[") != NULL);
+}
+
+/* Takes ownership of the id and pattern sds strings. Returns NULL if the
+ * pattern has wildcards outside of the file name. */
+narc_glob
+*new_glob(char *id, char *pattern)
+{
+	narc_glob *glob;
+	char *slash = strrchr(pattern, '/');
+	sds dir = dir_name(pattern);
+
+	if (is_glob_pattern(dir)) {
+		sdsfree(dir);
+		return NULL;
+	}
+
+	glob = (narc_glob *)zmalloc(sizeof(narc_glob));
+	glob->id      = id;
+	glob->pattern = pattern;
+	glob->dir     = dir;
+	glob->name    = sdsnew(slash ? slash + 1 : pattern);
+	glob->opts    = default_stream_opts();
+
+	return glob;
+}
+
+void
+free_glob(void *ptr)
+{
+	narc_glob *glob = (narc_glob *)ptr;
+
+	sdsfree(glob->id);
+	sdsfree(glob->pattern);
+	sdsfree(glob->dir);
+	sdsfree(glob->name);
+	if (glob->opts != default_stream_opts())
+		free_stream_opts(glob->opts);
+	zfree(glob);
+}
+
+/* Expand every glob into streams and watch their directories for files
+ * coming and going. Must run before the streams are initialized. */
+void
+init_discovery(void)
+{
+	listIter *iter;
+	listNode *node;
+	narc_glob *glob;
+	narc_dir_watch *watch;
+
+	iter = listGetIterator(server.globs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		glob = (narc_glob *)listNodeValue(node);
+		expand_glob(glob);
+
+		if ((watch = find_dir_watch(glob->dir)) == NULL) {
+			watch = new_dir_watch(glob->dir);
+			listAddNodeTail(server.dir_watches, (void *)watch);
+		}
+		listAddNodeTail(watch->globs, (void *)glob);
+	}
+	listReleaseIterator(iter);
+
+	iter = listGetIterator(server.dir_watches, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		start_dir_watcher((narc_dir_watch *)listNodeValue(node));
+	listReleaseIterator(iter);
+}
+
+/* Watch the directory of a hibernating stream, the stream has no watch
+ * on its file anymore. */
+int
+watch_stream_dir(narc_stream *stream)
+{
+	sds dir = dir_name(stream->file);
+	narc_dir_watch *watch = find_dir_watch(dir);
+
+	if (watch == NULL) {
+		watch = new_dir_watch(dir);
+		start_dir_watcher(watch);
+		listAddNodeTail(server.dir_watches, (void *)watch);
+	}
+	sdsfree(dir);
+
+	if (watch->fs_events == NULL)
+		return NARC_ERR;
+
+	watch->sleepers++;
+	return NARC_OK;
+}
+
+/* The stream woke up or was retired. A directory watched for none of
+ * the globs is only kept while streams in it hibernate. */
+void
+unwatch_stream_dir(narc_stream *stream)
+{
+	sds dir = dir_name(stream->file);
+	narc_dir_watch *watch = find_dir_watch(dir);
+
+	sdsfree(dir);
+	if (watch == NULL)
+		return;
+
+	if (--watch->sleepers == 0 && listLength(watch->globs) == 0)
+		listDelNode(server.dir_watches, listSearchKey(server.dir_watches, watch));
+}
+
+void
+clean_discovery(void)
+{
+	listIter *iter;
+	listNode *node;
+	narc_dir_watch *watch;
+
+	iter = listGetIterator(server.dir_watches, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		watch = (narc_dir_watch *)listNodeValue(node);
+		if (watch->fs_events != NULL) {
+			uv_close((uv_handle_t *)watch->fs_events, (uv_close_cb)zfree);
+			watch->fs_events = NULL;
+		}
+	}
+	listReleaseIterator(iter);
+}
@@ -0,0 +1,51 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_DISCOVERY
+#define NARC_DISCOVERY
+
+#include "narc.h"
+#include "stream.h"
+#include "adlist.h"	/* Linked lists */
+
+#include <uv.h>		/* Event driven programming library */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* A 'stream <id> <pattern>' directive whose file name contains wildcards. */
+typedef struct {
+	char	*id;		/* message id template, %f is replaced by the file name */
+	char	*pattern;	/* full glob pattern */
+	char	*dir;		/* directory the pattern matches in */
+	char	*name;		/* file name part of the pattern */
+	narc_stream_opts *opts;	/* options of the streams the glob creates */
+} narc_glob;
+
+/* One watcher per directory, shared by all globs matching in it. */
+typedef struct {
+	char		*dir;		/* watched directory */
+	list		*globs;		/* globs matching in this directory */
+	uv_fs_event_t	*fs_events;	/* directory watcher */
+	int		sleepers;	/* hibernating streams woken up by it */
+} narc_dir_watch;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_dir_watcher(narc_dir_watch *watch);
+void	start_vanished_timer(narc_stream *stream);
+
+/* api */
+int	is_glob_pattern(char *file);
+narc_glob	*new_glob(char *id, char *pattern);
+void	free_glob(void *ptr);
+void	free_dir_watch(void *ptr);
+int	watch_stream_dir(narc_stream *stream);
+void	unwatch_stream_dir(narc_stream *stream);
+void	init_discovery(void);
+void	clean_discovery(void);
+
+#endif
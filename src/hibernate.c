@@ -0,0 +1,362 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "hibernate.h"
+#include "stream.h"
+#include "discovery.h"
+#include "poller.h"
+
+#include "adlist.h"	/* Linked lists */
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* A stream idle for hibernate-after seconds, or the least recently used
+ * idle one once max-open-files streams hold their file, hibernates: the
+ * file is closed and the read buffers are freed. The device, inode and
+ * offset of the file are kept, and its directory is watched instead of
+ * the file itself. The next change in there wakes the stream up, the
+ * file is opened again and read from the offset, or from the start if
+ * it was replaced in the meantime. A polled stream keeps polling the
+ * path while it hibernates.
+ *
+ * Streams holding a file are kept in 'lru', most recently active first.
+ * When max-open-files is reached and no stream can make room, a stream
+ * opened for the first time is stat'd and hibernates right away, at the
+ * offset it would have started reading from. A hibernating stream that
+ * changes waits in 'waiting' until a stream is done reading. */
+
+static list *lru = NULL;
+static list *waiting = NULL;
+static uv_timer_t *sweep_timer = NULL;
+static uv_idle_t *wake_idle = NULL;
+static int sleeping = 0;
+static long long hibernations = 0;
+static long long wakeups = 0;
+static long long evictions = 0;
+static int over_limit = 0;
+
+/*============================ Utility functions ============================ */
+
+/* Only a stream that read all of its file and has nothing in flight or
+ * pending can let go of it. */
+static int
+can_hibernate(narc_stream *stream)
+{
+	return (stream->fd >= 0
+	    && !stream->hibernating
+	    && !stream->retired
+	    && stream->requests == 0
+	    && stream->lock == NARC_STREAM_UNLOCKED
+	    && !stream->scheduled
+	    && !stream->drain
+	    && !stream->dirty
+	    && !stream->mmap
+	    && !stream->truncate
+	    && stream->open_timer == NULL
+	    && stream->event_lines == 0
+	    && stream->offset >= stream->size
+	    && (stream->change_timer == NULL || !uv_is_active((uv_handle_t *)stream->change_timer)));
+}
+
+/* Arrange for the next change to wake the stream up. A stream that is
+ * polled only keeps its poll watcher, the others watch the directory. */
+static int
+sleep_stream(narc_stream *stream)
+{
+	int state = NARC_STREAM_ASLEEP;
+
+	if (stream->fs_events != NULL || stream->poll_timer == NULL) {
+		if (watch_stream_dir(stream) == NARC_OK)
+			state |= NARC_STREAM_DIR_WATCH;
+		else if (stream->poll_timer == NULL)
+			return NARC_ERR;
+	}
+
+	stream->hibernating = state;
+	stream->current_line  = sdsRemoveFreeSpace(stream->current_line);
+	stream->previous_line = sdsRemoveFreeSpace(stream->previous_line);
+	resize_buffer(stream, 0);
+
+	sleeping++;
+	hibernations++;
+	return NARC_OK;
+}
+
+static int
+hibernate_stream(narc_stream *stream)
+{
+	uv_fs_t close_req;
+
+	if (!can_hibernate(stream) || sleep_stream(stream) == NARC_ERR)
+		return NARC_ERR;
+
+	narc_log(NARC_VERBOSE, "Hibernating %s", stream->file);
+
+	if (stream->fs_events != NULL) {
+		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)zfree);
+		stream->fs_events = NULL;
+	}
+
+	uv_fs_close(server.loop, &close_req, stream->fd, NULL);
+	uv_fs_req_cleanup(&close_req);
+	stream->fd = -1;
+
+	release_open_file(stream);
+	return NARC_OK;
+}
+
+/* Hibernate the least recently used stream that can. Returns 0 if none
+ * could. */
+static int
+evict_stream(void)
+{
+	listIter iter;
+	listNode *node;
+
+	listRewindTail(lru, &iter);
+	while ((node = listNext(&iter)) != NULL) {
+		if (hibernate_stream(listNodeValue(node)) == NARC_OK) {
+			evictions++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Returns 1 if one more stream can hold its file. */
+static int
+room_for_file(void)
+{
+	return (server.max_open_files == 0
+	    || (int)listLength(lru) < server.max_open_files
+	    || evict_stream());
+}
+
+/* A stream that never read its file takes the offset and inode it would
+ * have started from, and hibernates without opening it. */
+static int
+sleep_unopened_stream(narc_stream *stream)
+{
+	uv_fs_t req;
+	int err;
+
+	if (stream->size >= 0)
+		return NARC_ERR;
+
+	err = uv_fs_stat(server.loop, &req, stream->file, NULL);
+	if (err == 0)
+		update_file_stat(stream, &req.statbuf);
+	uv_fs_req_cleanup(&req);
+
+	if (err < 0 || sleep_stream(stream) == NARC_ERR)
+		return NARC_ERR;
+
+	narc_log(NARC_VERBOSE, "No room to open %s, hibernating it", stream->file);
+	return NARC_OK;
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_hibernate_timeout(uv_timer_t *timer)
+{
+	uint64_t now = uv_now(server.loop);
+	listIter iter;
+	listNode *node;
+	narc_stream *stream;
+
+	listRewindTail(lru, &iter);
+	while (server.hibernate_after > 0 && (node = listNext(&iter)) != NULL) {
+		stream = listNodeValue(node);
+		if (now - stream->last_active < server.hibernate_after * 1000)
+			break;
+		hibernate_stream(stream);
+	}
+	wake_waiting_streams();
+}
+
+void
+handle_wake_idle(uv_idle_t *handle)
+{
+	narc_stream *stream;
+
+	while (listLength(waiting) > 0 && room_for_file()) {
+		stream = listNodeValue(listFirst(waiting));
+		listDelNode(waiting, listFirst(waiting));
+		stream->hibernating &= ~NARC_STREAM_WAITING;
+		wake_stream(stream);
+	}
+
+	// the next read that finishes may free a file
+	uv_idle_stop(handle);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_hibernate_timer(void)
+{
+	if (server.hibernate_after == 0 && server.max_open_files == 0)
+		return;
+
+	sweep_timer = zmalloc(sizeof(uv_timer_t));
+	uv_timer_init(server.loop, sweep_timer);
+	uv_timer_start(sweep_timer, handle_hibernate_timeout,
+		NARC_HIBERNATE_SWEEP_INTERVAL, NARC_HIBERNATE_SWEEP_INTERVAL);
+}
+
+void
+wake_waiting_streams(void)
+{
+	if (listLength(waiting) > 0 && !uv_is_active((uv_handle_t *)wake_idle))
+		uv_idle_start(wake_idle, handle_wake_idle);
+}
+
+/*================================== API ==================================== */
+
+void
+init_hibernation(void)
+{
+	lru     = listCreate();
+	waiting = listCreate();
+
+	wake_idle = zmalloc(sizeof(uv_idle_t));
+	uv_idle_init(server.loop, wake_idle);
+	start_hibernate_timer();
+}
+
+void
+clean_hibernation(void)
+{
+	if (sweep_timer != NULL)
+		uv_close((uv_handle_t *)sweep_timer, (uv_close_cb)zfree);
+	uv_close((uv_handle_t *)wake_idle, (uv_close_cb)zfree);
+	listRelease(lru);
+	listRelease(waiting);
+}
+
+/* Called before a stream opens its file, makes room for it under
+ * max-open-files. Returns 0 if the stream hibernated instead. */
+int
+reserve_open_file(narc_stream *stream)
+{
+	if (stream->lru_node != NULL)
+		return 1;
+
+	if (server.max_open_files > 0 && (int)listLength(lru) >= server.max_open_files
+	    && !evict_stream()) {
+		if (sleep_unopened_stream(stream) == NARC_OK)
+			return 0;
+		if (!over_limit)
+			narc_log(NARC_WARNING, "No idle stream to close, going over max-open-files %d",
+				server.max_open_files);
+		over_limit = 1;
+	} else
+		over_limit = 0;
+
+	listAddNodeHead(lru, stream);
+	stream->lru_node    = listFirst(lru);
+	stream->last_active = uv_now(server.loop);
+	return 1;
+}
+
+/* The stream closed its file, or gave up opening it. */
+void
+release_open_file(narc_stream *stream)
+{
+	if (stream->lru_node == NULL)
+		return;
+
+	listDelNode(lru, stream->lru_node);
+	stream->lru_node = NULL;
+}
+
+/* The stream was retired. */
+void
+forget_stream(narc_stream *stream)
+{
+	release_open_file(stream);
+
+	if (stream->hibernating & NARC_STREAM_WAITING)
+		listDelNode(waiting, listSearchKey(waiting, stream));
+	if (stream->hibernating & NARC_STREAM_DIR_WATCH)
+		unwatch_stream_dir(stream);
+	if (stream->hibernating)
+		sleeping--;
+	stream->hibernating = 0;
+}
+
+/* The stream read something or its file changed. */
+void
+touch_stream(narc_stream *stream)
+{
+	stream->last_active = uv_now(server.loop);
+
+	if (stream->lru_node != NULL && stream->lru_node != listFirst(lru)) {
+		listDelNode(lru, stream->lru_node);
+		listAddNodeHead(lru, stream);
+		stream->lru_node = listFirst(lru);
+	}
+}
+
+/* Open the file of a hibernating stream again after a change. */
+void
+wake_stream(narc_stream *stream)
+{
+	uv_fs_t req;
+
+	if (!stream->hibernating || (stream->hibernating & NARC_STREAM_WAITING))
+		return;
+
+	if (!room_for_file()) {
+		stream->hibernating |= NARC_STREAM_WAITING;
+		listAddNodeTail(waiting, stream);
+		return;
+	}
+
+	if (stream->hibernating & NARC_STREAM_DIR_WATCH)
+		unwatch_stream_dir(stream);
+	stream->hibernating = 0;
+	stop_poll_watcher(stream);
+
+	sleeping--;
+	wakeups++;
+	narc_log(NARC_VERBOSE, "Waking up %s", stream->file);
+
+	// rotated while the stream was asleep, all of the new file is new
+	if (uv_fs_stat(server.loop, &req, stream->file, NULL) == 0
+	    && (req.statbuf.st_dev != stream->dev || req.statbuf.st_ino != stream->inode)) {
+		narc_log(NARC_NOTICE, "%s was replaced while hibernating, reading from the start",
+			stream->file);
+		stream->offset = 0;
+		stream->size   = 0;
+	}
+	uv_fs_req_cleanup(&req);
+
+	if (stream->change_stamp == 0)
+		stream->change_stamp = uv_hrtime();
+
+	resize_buffer(stream, NARC_MAX_BUFF_SIZE);
+	start_file_open(stream);
+}
+
+sds
+cat_hibernate_info(sds info)
+{
+	return sdscatprintf(info,
+		"# Hibernation\r\n"
+		"open_streams:%lu\r\n"
+		"hibernating_streams:%d\r\n"
+		"streams_waiting_for_file:%lu\r\n"
+		"hibernations:%lld\r\n"
+		"wakeups:%lld\r\n"
+		"evictions:%lld\r\n",
+		listLength(lru),
+		sleeping,
+		listLength(waiting),
+		hibernations,
+		wakeups,
+		evictions);
+}
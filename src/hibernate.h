@@ -0,0 +1,33 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_HIBERNATE
+#define NARC_HIBERNATE
+
+#include "narc.h"
+#include "stream.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* Static hibernation configuration */
+#define NARC_HIBERNATE_SWEEP_INTERVAL	1000	/* Millisecond delay between looks for idle streams */
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_hibernate_timer(void);
+void	wake_waiting_streams(void);
+
+/* api */
+void	init_hibernation(void);
+void	clean_hibernation(void);
+int	reserve_open_file(narc_stream *stream);
+void	release_open_file(narc_stream *stream);
+void	forget_stream(narc_stream *stream);
+void	touch_stream(narc_stream *stream);
+void	wake_stream(narc_stream *stream);
+sds	cat_hibernate_info(sds info);
+
+#endif
@@ -5,8 +5,16 @@
 #include "config.h"
 #include "tcp_client.h"
 #include "udp_client.h"
-
-// #include "malloc.h"	/* total memory usage aware version of malloc/free */
+#include "spool.h"
+#include "offsets.h"
+#include "discovery.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "poller.h"
+#include "hibernate.h"
+#include "registry.h"
+
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
 #include "sds.h"	/* dynamic safe strings */
 #include "util.h"	/* Misc functions useful in many places */
 
@@ -17,6 +25,10 @@
 #include <unistd.h>	/* standard symbolic constants and types */
 #include <locale.h>	/* set program locale */
 #include <string.h>	/* string operations */
+#include <sys/syscall.h>	/* system call numbers */
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>	/* io_uring parameters */
+#endif
 
 /*================================= Globals ================================= */
 
@@ -78,20 +90,82 @@ narc_log(int level, const char *fmt, ...)
 	narc_log_raw(level,msg);
 }
 
+/* Append "<pri>time stream-id <header><body>\n" to 'buf'. Everything up
+ * to the stream's header is cached in server.message_prefix, so a message
+ * is put together with a single allocation at most and three memcpy. */
+sds
+format_message(sds buf, sds header, char *body, int len)
+{
+	size_t prefix_len = sdslen(server.message_prefix);
+	size_t header_len = sdslen(header);
+	size_t total      = prefix_len + header_len + len + 1;
+	char *p;
+
+	buf = sdsMakeRoomFor(buf, total);
+	p   = buf + sdslen(buf);
+
+	memcpy(p, server.message_prefix, prefix_len);
+	p += prefix_len;
+	memcpy(p, header, header_len);
+	p += header_len;
+	memcpy(p, body, len);
+	p[len] = '\n';
+
+	sdsIncrLen(buf, total);
+	return buf;
+}
+
+/* Convert an amount of bytes into a human readable string in the form
+ * of 100B, 2G, 100M, 4K, and so forth. */
+void
+bytes_to_human(char *s, unsigned long long n)
+{
+	double d;
+
+	if (n < 1024) {
+		sprintf(s,"%lluB",n);
+	} else if (n < (1024*1024)) {
+		d = (double)n/(1024);
+		sprintf(s,"%.2fK",d);
+	} else if (n < (1024LL*1024*1024)) {
+		d = (double)n/(1024*1024);
+		sprintf(s,"%.2fM",d);
+	} else {
+		d = (double)n/(1024LL*1024*1024);
+		sprintf(s,"%.2fG",d);
+	}
+}
+
+/* Apply maxmemory-policy. Returns 1 if the message must be dropped. */
+int
+handle_maxmemory(void)
+{
+	if (!server.maxmemory_reached) {
+		narc_log(NARC_WARNING, "Memory usage above maxmemory (%lld bytes)", server.maxmemory);
+		server.maxmemory_reached = 1;
+	}
+
+	if (server.maxmemory_policy == NARC_MAXMEMORY_PAUSE) {
+		server.paused |= NARC_PAUSE_MEMORY;
+		return 0;
+	}
+
+	server.stat_dropped_messages++;
+	return 1;
+}
+
 void
-handle_message(char *id, char *body)
+handle_message(sds header, char *body, int len)
 {
-	char *message;
-	message = sdscatprintf(sdsempty(), "<%d>%s %s %s %s\n",
-				server.stream_facility + server.stream_priority,
-				server.time, server.stream_id, id, body);
+	if (server.maxmemory > 0 && zmalloc_used_memory() > (size_t)server.maxmemory && handle_maxmemory())
+		return;
 
 	switch (server.protocol) {
 		case NARC_PROTO_UDP :
-			submit_udp_message(message);
+			submit_udp_message(format_message(pool_buffer(), header, body, len));
 			break;
 		case NARC_PROTO_TCP :
-			submit_tcp_message(message);
+			append_tcp_message(header, body, len);
 			break;
 		case NARC_PROTO_SYSLOG :
 			narc_log(NARC_WARNING, "syslog is not yet implemented");
@@ -104,8 +178,91 @@ void
 calculate_time(uv_timer_t* handle)
 {
 	struct timeval tv;
+	char now[sizeof(server.time)];
+
 	gettimeofday(&tv,NULL);
-	strftime(server.time,sizeof(server.time),"%b %d %T",localtime(&tv.tv_sec));
+	strftime(now,sizeof(now),"%b %d %T",localtime(&tv.tv_sec));
+
+	// the timer runs twice a second, the prefix only changes once
+	if (server.message_prefix != NULL && !strcmp(now, server.time))
+		return;
+
+	memcpy(server.time, now, sizeof(server.time));
+	if (server.message_prefix == NULL)
+		server.message_prefix = sdsempty();
+	sdsclear(server.message_prefix);
+	server.message_prefix = sdscatprintf(server.message_prefix, "<%d>%s %s ",
+		server.stream_facility + server.stream_priority,
+		server.time, server.stream_id);
+}
+
+/* Lift the maxmemory measures once usage is back under the limit. */
+void
+check_memory(uv_timer_t* handle)
+{
+	if (!server.maxmemory_reached || zmalloc_used_memory() > (size_t)server.maxmemory)
+		return;
+
+	narc_log(NARC_WARNING, "Memory usage back under maxmemory, %lld messages dropped so far",
+		server.stat_dropped_messages);
+	server.maxmemory_reached = 0;
+
+	if (server.paused & NARC_PAUSE_MEMORY) {
+		server.paused &= ~NARC_PAUSE_MEMORY;
+		if (!server.paused)
+			resume_reads();
+	}
+}
+
+/* Whether the kernel lets us set up a ring, and libuv is recent enough
+ * (1.45) to submit file operations to one. */
+int
+io_uring_supported(void)
+{
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+	struct io_uring_params params;
+	int fd;
+
+	if (uv_version() < 0x012d00)
+		return 0;
+
+	memset(&params, 0, sizeof(params));
+	if ((fd = syscall(__NR_io_uring_setup, 1, &params)) < 0)
+		return 0;
+	close(fd);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* libuv reads UV_USE_IO_URING when the loop is created. With it, the
+ * opens, stats and reads of streams go to an io_uring instead of the
+ * threadpool, which is left to the mmap catch-up and name resolution.
+ * An UV_USE_IO_URING already in the environment wins over io-backend. */
+void
+select_io_backend(void)
+{
+	char *env = getenv("UV_USE_IO_URING");
+	int uring = 0;
+
+	if (env != NULL) {
+		narc_log(NARC_NOTICE, "File io backend left to UV_USE_IO_URING=%s", env);
+		return;
+	}
+
+	switch (server.io_backend) {
+	case NARC_IO_AUTO :
+		uring = io_uring_supported();
+		break;
+	case NARC_IO_URING :
+		if (!(uring = io_uring_supported()))
+			narc_log(NARC_WARNING, "io_uring is not available, falling back to the threadpool");
+		break;
+	}
+
+	setenv("UV_USE_IO_URING", uring ? "1" : "0", 0);
+	narc_log(NARC_NOTICE, "File io through %s", uring ? "io_uring" : "the threadpool");
 }
 
 void
@@ -114,6 +271,12 @@ start_timer_loop()
 	calculate_time(NULL);
 	uv_timer_init(server.loop,&server.time_timer);
 	uv_timer_start(&server.time_timer,calculate_time,500,500);
+
+	if (server.maxmemory > 0) {
+		uv_timer_init(server.loop,&server.memory_timer);
+		uv_timer_start(&server.memory_timer,check_memory,
+			NARC_MEMORY_CHECK_INTERVAL,NARC_MEMORY_CHECK_INTERVAL);
+	}
 }
 
 /*=========================== Server initialization ========================= */
@@ -121,45 +284,89 @@ start_timer_loop()
 void
 init_server_config(void)
 {
-	server.pidfile = strdup(NARC_DEFAULT_PIDFILE);
+	server.pidfile = zstrdup(NARC_DEFAULT_PIDFILE);
 	server.arch_bits = (sizeof(long) == 8) ? 64 : 32;
-	server.host = strdup(NARC_DEFAULT_HOST);
+	server.host = zstrdup(NARC_DEFAULT_HOST);
 	server.port = NARC_DEFAULT_PORT;
 	server.protocol = NARC_DEFAULT_PROTO;
-	server.stream_id = strdup(NARC_DEFAULT_STREAM_ID);
+	server.stream_id = zstrdup(NARC_DEFAULT_STREAM_ID);
 	server.stream_facility = NARC_DEFAULT_STREAM_FACILITY;
 	server.stream_priority = NARC_DEFAULT_STREAM_PRIORITY;
 	server.verbosity = NARC_DEFAULT_VERBOSITY;
 	server.daemonize = NARC_DEFAULT_DAEMONIZE;
-	server.logfile = strdup(NARC_DEFAULT_LOGFILE);
+	server.logfile = zstrdup(NARC_DEFAULT_LOGFILE);
 	server.syslog_enabled = NARC_DEFAULT_SYSLOG_ENABLED;
-	server.syslog_ident = strdup(NARC_DEFAULT_SYSLOG_IDENT);
+	server.syslog_ident = zstrdup(NARC_DEFAULT_SYSLOG_IDENT);
 	server.syslog_facility = LOG_LOCAL0;
 	server.max_open_attempts = NARC_DEFAULT_OPEN_ATTEMPTS;
 	server.open_retry_delay = NARC_DEFAULT_OPEN_DELAY;
+	server.rotate_grace_period = NARC_DEFAULT_ROTATE_GRACE;
 	server.max_connect_attempts = NARC_DEFAULT_CONNECT_ATTEMPTS;
 	server.connect_retry_delay = NARC_DEFAULT_CONNECT_DELAY;
+	server.tcp_batch_bytes = NARC_DEFAULT_TCP_BATCH_BYTES;
+	server.tcp_flush_interval = NARC_DEFAULT_TCP_FLUSH_INTERVAL;
+	server.tcp_high_water = NARC_DEFAULT_TCP_HIGH_WATER;
+	server.tcp_low_water = NARC_DEFAULT_TCP_LOW_WATER;
+	server.tcp_queue_limit = NARC_DEFAULT_TCP_QUEUE_LIMIT;
+	server.spool_dir = zstrdup(NARC_DEFAULT_SPOOL_DIR);
+	server.spool = NULL;
+	server.spool_max_size = NARC_DEFAULT_SPOOL_MAX_SIZE;
+	server.spool_segment_size = NARC_DEFAULT_SPOOL_SEGMENT_SIZE;
+	server.spool_replay_rate = NARC_DEFAULT_SPOOL_REPLAY_RATE;
+	server.spool_sync_interval = NARC_DEFAULT_SPOOL_SYNC_INTERVAL;
 	server.rate_limit = NARC_DEFAULT_RATE_LIMIT;
 	server.rate_time = NARC_DEFAULT_RATE_TIME;
 	server.truncate_limit = NARC_DEFAULT_TRUNCATE_LIMIT;
+	server.max_message_size = NARC_DEFAULT_MAX_MESSAGE_SIZE;
+	server.offset_registry = zstrdup(NARC_DEFAULT_OFFSET_REGISTRY);
+	server.offset_checkpoint_interval = NARC_DEFAULT_OFFSET_CHECKPOINT;
+	server.message_prefix = NULL;
+	server.max_read_size = NARC_DEFAULT_MAX_READ_SIZE;
+	server.read_budget = NARC_DEFAULT_READ_BUDGET;
+	server.fast_read_max = NARC_DEFAULT_FAST_READ_MAX;
+	server.change_debounce = NARC_DEFAULT_CHANGE_DEBOUNCE;
+	server.mmap_threshold = NARC_DEFAULT_MMAP_THRESHOLD;
+	server.io_backend = NARC_DEFAULT_IO_BACKEND;
+	server.watch = NARC_DEFAULT_WATCH;
+	server.poll_min_interval = NARC_DEFAULT_POLL_MIN_INTERVAL;
+	server.poll_max_interval = NARC_DEFAULT_POLL_MAX_INTERVAL;
+	server.hibernate_after = NARC_DEFAULT_HIBERNATE_AFTER;
+	server.max_open_files = NARC_DEFAULT_MAX_OPEN_FILES;
+	server.maxmemory = NARC_DEFAULT_MAXMEMORY;
+	server.maxmemory_policy = NARC_DEFAULT_MAXMEMORY_POLICY;
+	server.maxmemory_reached = 0;
+	server.paused = 0;
+	server.stat_dropped_messages = 0;
 	server.streams = listCreate();
 	listSetFreeMethod(server.streams, free_stream);
+	init_registry();
+	server.globs = listCreate();
+	listSetFreeMethod(server.globs, free_glob);
+	server.dir_watches = listCreate();
+	listSetFreeMethod(server.dir_watches, free_dir_watch);
 }
 
 void
 clean_server_config(void)
 {
-	free(server.pidfile);
-	free(server.host);
-	free(server.stream_id);
-	free(server.logfile);
-	free(server.syslog_ident);
+	zfree(server.pidfile);
+	zfree(server.host);
+	zfree(server.stream_id);
+	zfree(server.logfile);
+	zfree(server.syslog_ident);
+	zfree(server.spool_dir);
+	zfree(server.offset_registry);
+	listRelease(server.dir_watches);
+	listRelease(server.globs);
+	clean_registry();
+	if (server.spool != NULL)
+		zfree((narc_spool *)server.spool);
 	switch (server.protocol) {
 	case NARC_PROTO_UDP :
-		free((narc_udp_client *)server.client);
+		zfree((narc_udp_client *)server.client);
 		break;
 	case NARC_PROTO_TCP :
-		free((narc_tcp_client *)server.client);
+		zfree((narc_tcp_client *)server.client);
 		break;
 	}
 
@@ -171,11 +378,17 @@ init_server(void)
 	if (server.syslog_enabled)
 		openlog(server.syslog_ident, LOG_PID | LOG_NDELAY | LOG_NOWAIT, server.syslog_facility);
 
+	select_io_backend();
 	server.loop = uv_default_loop();
 
 	listIter *iter;
 	listNode *node;
 
+	init_scheduler();
+	init_hibernation();
+	init_discovery();
+	init_offsets();
+
 	iter = listGetIterator(server.streams, AL_START_HEAD);
 	while ((node = listNext(iter)) != NULL)
 		init_stream((narc_stream *)listNodeValue(node));
@@ -187,6 +400,7 @@ init_server(void)
 			init_udp_client();
 			break;
 		case NARC_PROTO_TCP :
+			init_spool();
 			init_tcp_client();
 			break;
 		case NARC_PROTO_SYSLOG :
@@ -199,14 +413,38 @@ init_server(void)
 void
 clean_server(void)
 {
+	listIter *iter;
+	listNode *node;
+
+	// writes still completing must not resume reads of freed streams
+	server.paused |= NARC_PAUSE_SHUTDOWN;
+
+	// pending multiline events and repeat counts go out before the
+	// offsets are checkpointed past them
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		flush_stream((narc_stream *)listNodeValue(node));
+	listReleaseIterator(iter);
+
 	switch (server.protocol) {
 		case NARC_PROTO_UDP :
 			clean_udp_client();
 			break;
 		case NARC_PROTO_TCP :
 			clean_tcp_client();
+			clean_spool();
 			break;
 	}
+
+	// the tcp batch and the spool are flushed, the offsets can follow
+	clean_offsets();
+
+	log_info(NARC_DEBUG);
+
+	clean_streams();
+	clean_discovery();
+	clean_scheduler();
+	clean_hibernation();
 }
 
 /* =================================== Main! ================================ */
@@ -275,13 +513,91 @@ narc_set_proc_title(char *title)
 #endif
 }
 
+void
+narc_out_of_memory_handler(size_t allocation_size)
+{
+	narc_log(NARC_WARNING, "Out Of Memory allocating %zu bytes!", allocation_size);
+	abort();
+}
+
+sds
+gen_narc_info_string(void)
+{
+	sds info = sdsempty();
+	char hmem[64], hmax[64];
+
+	bytes_to_human(hmem, zmalloc_used_memory());
+	bytes_to_human(hmax, server.maxmemory);
+
+	info = sdscatprintf(info,
+		"# Memory\r\n"
+		"used_memory:%zu\r\n"
+		"used_memory_human:%s\r\n"
+		"used_memory_rss:%zu\r\n"
+		"maxmemory:%lld\r\n"
+		"maxmemory_human:%s\r\n"
+		"maxmemory_policy:%s\r\n"
+		"dropped_messages:%lld\r\n"
+		"reads_paused:%d\r\n"
+		"tcp_queue_size:%zu\r\n"
+		"tcp_queue_pauses:%lld\r\n"
+		"tcp_queue_dropped_messages:%lld\r\n"
+		"spool_dropped_bytes:%lld\r\n"
+		"# Streams\r\n"
+		"streams:%lu\r\n",
+		zmalloc_used_memory(),
+		hmem,
+		zmalloc_get_rss(),
+		server.maxmemory,
+		hmax,
+		server.maxmemory_policy == NARC_MAXMEMORY_PAUSE ? "pause" : "drop",
+		server.stat_dropped_messages,
+		server.paused != 0,
+		tcp_queue_size(),
+		tcp_queue_pauses(),
+		tcp_queue_dropped(),
+		spool_dropped(),
+		listLength(server.streams));
+
+	info = cat_read_info(info);
+	info = cat_scheduler_info(info);
+	info = cat_poll_info(info);
+	info = cat_hibernate_info(info);
+	return cat_pool_info(info);
+}
+
+/* Write the INFO report to the log at 'level', one line per field. */
+void
+log_info(int level)
+{
+	sds info, *lines;
+	int count, j;
+
+	if (level < server.verbosity)
+		return;
+
+	info  = gen_narc_info_string();
+	lines = sdssplitlen(info, sdslen(info), "\r\n", 2, &count);
+	for (j = 0; j < count; j++)
+		if (sdslen(lines[j]) > 0)
+			narc_log(level, "%s", lines[j]);
+	sdsfreesplitres(lines, count);
+	sdsfree(info);
+}
+
+void
+info_signal_handler(uv_signal_t *handle, int signum)
+{
+	log_info(NARC_NOTICE);
+}
+
 void
 close_handles(uv_handle_t* handle, void* arg) {
 	if (!(handle->flags & (0x01 | 0x02))){
-		if (handle->type == UV_SIGNAL || handle == &server.time_timer) {
+		if (handle->type == UV_SIGNAL || handle == (uv_handle_t *)&server.time_timer || handle == (uv_handle_t *)&server.memory_timer) {
 			uv_close(handle, NULL);
 		} else {
-			uv_close(handle, (uv_close_cb)free);
+			uv_close(handle, (uv_close_cb)zfree);
 		}
 	}
 }
@@ -298,8 +614,8 @@ void signal_handler(uv_signal_t *handle, int signum) {
 	uv_close((uv_handle_t*)handle, NULL);
 	uv_signal_stop(&server.loop->child_watcher);
 	uv_close((uv_handle_t*)&server.loop->child_watcher, NULL);
-	listRelease(server.streams);
 	clean_server();
+	listRelease(server.streams);
 	stop();
 	uv_walk(server.loop, close_handles, NULL);
 }
@@ -308,6 +624,11 @@ int
 main(int argc, char **argv)
 {
 	setlocale(LC_COLLATE,"");
+	zmalloc_set_oom_handler(narc_out_of_memory_handler);
+#ifdef HAVE_MALLOC_SIZE
+	// count what libuv allocates too, write queues included
+	uv_replace_allocator(zmalloc, zrealloc, zcalloc, zfree);
+#endif
 	init_server_config();
 
 	if (argc >= 2) {
@@ -361,6 +682,10 @@ main(int argc, char **argv)
 	uv_signal_init(server.loop, &quit_signal);
 	uv_signal_start(&quit_signal, signal_handler, SIGTERM);
 
+	uv_signal_t info_signal;
+	uv_signal_init(server.loop, &info_signal);
+	uv_signal_start(&info_signal, info_signal_handler, SIGUSR1);
+
 	uv_run(server.loop, UV_RUN_DEFAULT);
 	clean_server_config();
 	// listRelease(server.streams);
@@ -10,6 +10,7 @@
 #endif
 
 #include "adlist.h"	/* Linked lists */
+#include "sds.h"	/* dynamic safe strings */
 #include "version.h"	/* Version macro */
 
 #include <uv.h>		/* Event driven programming library */
@@ -25,7 +26,6 @@
 
 /* Static narc configuration */
 #define NARC_MAX_BUFF_SIZE 		4096
-#define NARC_MAX_MESSAGE_SIZE 		1024
 #define NARC_CONFIGLINE_MAX		1024
 #define NARC_MAX_LOGMSG_LEN		1024	/* Default maximum length of syslog messages */
 #define NARC_DEFAULT_DAEMONIZE   	0
@@ -43,10 +43,58 @@
 #define NARC_DEFAULT_OPEN_DELAY		3000
 #define NARC_DEFAULT_CONNECT_ATTEMPTS	2
 #define NARC_DEFAULT_CONNECT_DELAY	3000
+#define NARC_DEFAULT_TCP_BATCH_BYTES	16384	/* Flush tcp writes once this many bytes are queued */
+#define NARC_DEFAULT_TCP_FLUSH_INTERVAL	1	/* Millisecond delay before flushing queued tcp writes */
+#define NARC_DEFAULT_TCP_HIGH_WATER	1024*1024	/* Pause file reads above this many queued bytes */
+#define NARC_DEFAULT_TCP_LOW_WATER	1024*256	/* Resume file reads below this many queued bytes */
+#define NARC_DEFAULT_TCP_QUEUE_LIMIT	0	/* Drop messages above this many queued bytes, 0 never drops */
+#define NARC_DEFAULT_MAX_MESSAGE_SIZE	1023	/* Longer lines are cut, or split into fragments */
+#define NARC_MAX_MESSAGE_SIZE		65507	/* Largest UDP payload, the bound of max-message-size */
 #define NARC_DEFAULT_RATE_LIMIT		100
 #define NARC_DEFAULT_RATE_TIME		10
+#define NARC_DEFAULT_SPOOL_DIR		""	/* Spooling is disabled unless a directory is set */
+#define NARC_DEFAULT_SPOOL_MAX_SIZE	1024*1024*256
+#define NARC_DEFAULT_SPOOL_SEGMENT_SIZE	1024*1024*8
+#define NARC_DEFAULT_SPOOL_REPLAY_RATE	1000	/* Messages per second replayed from the spool */
+#define NARC_DEFAULT_SPOOL_SYNC_INTERVAL	1000	/* Millisecond delay between spool fsyncs */
+#define NARC_DEFAULT_ROTATE_GRACE	5000	/* Millisecond limit on draining a rotated file */
+#define NARC_DEFAULT_OFFSET_REGISTRY	""	/* Offsets are not persisted unless a file is set */
+#define NARC_DEFAULT_OFFSET_CHECKPOINT	1000	/* Millisecond delay between offset checkpoints */
+#define NARC_DEFAULT_MAX_READ_SIZE	1024*1024	/* Reads grow up to this many bytes while a stream is behind */
+#define NARC_DEFAULT_IO_BACKEND	NARC_IO_AUTO
+#define NARC_DEFAULT_MMAP_THRESHOLD	1024*1024*64	/* Map files this many bytes behind, 0 never maps */
+#define NARC_DEFAULT_FAST_READ_MAX	1024*64	/* Appends up to this many bytes are read on the loop */
+#define NARC_DEFAULT_CHANGE_DEBOUNCE	0	/* Millisecond delay between stats and reads of a changing file */
+#define NARC_DEFAULT_WATCH	NARC_WATCH_AUTO
+#define NARC_DEFAULT_POLL_MIN_INTERVAL	250	/* Millisecond delay between polls of a changing file */
+#define NARC_DEFAULT_POLL_MAX_INTERVAL	8000	/* Millisecond delay between polls of an idle file at most */
+#define NARC_DEFAULT_HIBERNATE_AFTER	0	/* Seconds a stream is idle before its file is closed, 0 never */
+#define NARC_DEFAULT_MAX_OPEN_FILES	0	/* Streams holding their file at once, 0 for no limit */
+#define NARC_DEFAULT_READ_BUDGET	1024*1024	/* Bytes of backlog read at a time across streams */
+#define NARC_DEFAULT_MAXMEMORY		0	/* No memory limit */
+#define NARC_DEFAULT_MAXMEMORY_POLICY	NARC_MAXMEMORY_DROP
+#define NARC_MEMORY_CHECK_INTERVAL	100	/* Millisecond delay between memory checks */
 #define NARC_DEFAULT_TRUNCATE_LIMIT	1024*1024*32 /* Default truncate files when they get to 32MB */
 
+/* file io backends */
+#define NARC_IO_AUTO		0	/* io_uring when the kernel and libuv support it */
+#define NARC_IO_THREADPOOL	1	/* libuv threadpool */
+#define NARC_IO_URING		2	/* io_uring, through libuv */
+
+/* file watching */
+#define NARC_WATCH_AUTO		0	/* inotify, and polling on filesystems it can miss changes on */
+#define NARC_WATCH_INOTIFY	1	/* inotify only */
+#define NARC_WATCH_POLL		2	/* polling only */
+
+/* maxmemory policies */
+#define NARC_MAXMEMORY_DROP	1	/* drop new messages */
+#define NARC_MAXMEMORY_PAUSE	2	/* stop reading files, they buffer the lines */
+
+/* Reasons for pausing file reads */
+#define NARC_PAUSE_MEMORY	(1<<0)
+#define NARC_PAUSE_QUEUE	(1<<1)	/* tcp write queue above tcp-high-water */
+#define NARC_PAUSE_SHUTDOWN	(1<<2)	/* stopping, reads never resume */
+
 /* Log levels */
 #define NARC_DEBUG		0
 #define NARC_VERBOSE		1
@@ -87,6 +135,7 @@ struct narc_server {
 	/* File access */
 	int 		max_open_attempts;		/* Max open attempts */
 	uint64_t 	open_retry_delay;		/* Millesecond delay between attempts */
+	uint64_t	rotate_grace_period;	/* Millisecond limit on draining a rotated file */
 
 	/* Server connection */
 	char		*host; 					/* Remote syslog host */
@@ -95,19 +144,57 @@ struct narc_server {
 	void		*client;				/* the client data pointer */
 	int 		max_connect_attempts;	/* Max connect attempts */
 	uint64_t	connect_retry_delay;	/* Millesecond delay between attempts */
+	int			tcp_batch_bytes;		/* Bytes to queue before writing to the tcp socket */
+	uint64_t	tcp_flush_interval;		/* Millisecond delay before flushing queued tcp writes */
+	long long	tcp_high_water;			/* Queued bytes above which file reads pause */
+	long long	tcp_low_water;			/* Queued bytes below which file reads resume */
+	long long	tcp_queue_limit;		/* Queued bytes above which messages are dropped */
+
+	/* Spool */
+	char		*spool_dir;				/* Directory for undeliverable messages */
+	void		*spool;					/* the spool data pointer */
+	long long	spool_max_size;			/* Max bytes kept on disk */
+	long long	spool_segment_size;		/* Bytes per spool segment file */
+	int			spool_replay_rate;		/* Messages per second replayed after reconnecting */
+	uint64_t	spool_sync_interval;	/* Millisecond delay between spool fsyncs */
 
 	/* Streams */
 	list		*streams;				/* Stream list */
+	list		*globs;					/* Stream glob patterns */
+	list		*dir_watches;			/* Directories watched for stream globs */
 	char 		*stream_id; 			/* prefix all messages */
 	int 		stream_facility;		/* Syslog stream facility */
 	int 		stream_priority;		/* Syslog stream priority */
 	int			rate_limit;				/* log rate limit */
 	int			rate_time;				/* log rate time */
 	int			truncate_limit;			/* size limit for truncating */
+	int			max_message_size;		/* Default max line length of streams */
+	char		*offset_registry;		/* File stream offsets are persisted to */
+	uint64_t	offset_checkpoint_interval;	/* Millisecond delay between offset checkpoints */
+	int			max_read_size;			/* Largest read of a stream that is behind */
+	int			read_budget;			/* Bytes of backlog read at a time across streams */
+	int			fast_read_max;			/* Largest append read on the loop, 0 for none */
+	uint64_t	change_debounce;		/* Millisecond delay between stats and reads of a changing file */
+	long long	mmap_threshold;			/* Bytes behind at which a file is mapped to catch up */
+	int			io_backend;				/* How files are opened, stat'd and read */
+	int			watch;					/* How files are watched for changes */
+	uint64_t	poll_min_interval;		/* Millisecond delay between polls of a changing file */
+	uint64_t	poll_max_interval;		/* Millisecond delay between polls of an idle file at most */
+	uint64_t	hibernate_after;		/* Seconds a stream is idle before its file is closed */
+	int			max_open_files;			/* Streams holding their file at once, 0 for no limit */
+
+	/* Memory */
+	long long	maxmemory;				/* Memory limit in bytes, 0 for none */
+	int			maxmemory_policy;		/* What to do above maxmemory */
+	int			maxmemory_reached;		/* Above maxmemory since the last check */
+	int			paused;					/* NARC_PAUSE_* flags, file reads stop while set */
+	long long	stat_dropped_messages;	/* Messages dropped because of maxmemory */
+	uv_timer_t	memory_timer;			/* Checks memory usage against maxmemory */
 
 	/* Time of day */
 	uv_timer_t 	time_timer;				/* runs ever hald second to update the current time */
 	char		time[16];				/* current time of day */
+	sds			message_prefix;			/* "<pri>time stream-id " for every message */
 };
 
 /*-----------------------------------------------------------------------------
@@ -120,8 +207,11 @@ extern struct narc_server	server;
  * Functions prototypes
  *----------------------------------------------------------------------------*/
 /* Core functions and callbacks */
-void	handle_message(char *id, char *message);
+sds	format_message(sds buf, sds header, char *body, int len);
+void	handle_message(sds header, char *body, int len);
 void	narc_out_of_memory_handler(size_t allocation_size);
+sds	gen_narc_info_string(void);
+void	log_info(int level);
 int	main(int argc, char **argv);
 void	init_server_config(void);
 void	init_server(void);
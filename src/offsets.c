@@ -0,0 +1,203 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "offsets.h"
+#include "stream.h"
+#include "registry.h"
+
+#include "adlist.h"	/* Linked lists */
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <errno.h>	/* system error numbers */
+#include <sys/stat.h>	/* file status */
+#include <uv.h>		/* Event driven programming library */
+#include <string.h>	/* string operations */
+
+/* The offset registry is a text file with one line per stream:
+ *
+ *   <device> <inode> <offset> <path>
+ *
+ * It is rewritten as a whole to a temporary file that is renamed over
+ * the registry, so a crash leaves either the old or the new checkpoint.
+ *
+ * A line counts as read once it is handed to the client, not once the
+ * remote end has it. Lines still in the tcp batch, in the socket write
+ * queue or in the spool's unsynced buffer when narc crashes are not read
+ * again: delivery across a crash is at most once. A clean shutdown
+ * flushes the client and the spool before the last checkpoint. */
+
+static uv_timer_t offsets_timer;
+
+/*============================ Utility functions ============================ */
+
+/* The offset up to which every line has been handed on. Bytes of a line
+ * that is still being assembled, and the lines of a multiline event that
+ * was not sent yet, are read again after a restart. */
+int64_t
+stream_checkpoint_offset(narc_stream *stream)
+{
+	int64_t offset = stream->offset - stream->index;
+
+	if (stream->event_lines > 0 && stream->event_start < offset)
+		return stream->event_start;
+	return offset;
+}
+
+/* Lines are matched to streams by device and inode first, so a file
+ * renamed while narc was down is resumed under its new name. Otherwise
+ * by path, the stream reads from the start if its file was replaced. */
+void
+load_offsets(void)
+{
+	FILE *fp;
+	char buf[NARC_CONFIGLINE_MAX+1];
+	unsigned long long dev, ino;
+	long long offset;
+	int pos, loaded = 0;
+	listIter *iter;
+	listNode *node;
+	narc_stream *stream;
+	struct stat st;
+
+	if ((fp = fopen(server.offset_registry, "r")) == NULL) {
+		if (errno != ENOENT)
+			narc_log(NARC_WARNING, "Can't open offset registry %s: %s",
+				server.offset_registry, strerror(errno));
+		return;
+	}
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		stream = (narc_stream *)listNodeValue(node);
+		if (stat(stream->file, &st) == 0)
+			set_stream_inode(stream, st.st_dev, st.st_ino);
+	}
+	listReleaseIterator(iter);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+		if (sscanf(buf, "%llu %llu %lld %n", &dev, &ino, &offset, &pos) != 3)
+			continue;
+
+		stream = find_stream_by_inode(dev, ino);
+		if (stream != NULL && !stream->resume) {
+			if (strcmp(stream->file, &buf[pos]))
+				narc_log(NARC_NOTICE, "%s was renamed to %s", &buf[pos], stream->file);
+		} else if ((stream = find_stream(&buf[pos])) != NULL && !stream->resume) {
+			// not the file of the last checkpoint, or gone for now
+			set_stream_inode(stream, dev, ino);
+		} else
+			continue;
+
+		stream->offset     = offset;
+		stream->checkpoint = offset;
+		stream->resume     = 1;
+		loaded++;
+	}
+	fclose(fp);
+
+	narc_log(NARC_NOTICE, "Loaded %d stream offsets from %s", loaded, server.offset_registry);
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_offsets_timeout(uv_timer_t *timer)
+{
+	checkpoint_offsets();
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_offsets_timer(void)
+{
+	uv_timer_init(server.loop, &offsets_timer);
+	uv_timer_start(&offsets_timer, handle_offsets_timeout,
+		server.offset_checkpoint_interval, server.offset_checkpoint_interval);
+}
+
+/*================================== API ==================================== */
+
+void
+init_offsets(void)
+{
+	if (server.offset_registry[0] == '\0')
+		return;
+
+	load_offsets();
+	start_offsets_timer();
+}
+
+void
+clean_offsets(void)
+{
+	if (server.offset_registry[0] == '\0')
+		return;
+
+	checkpoint_offsets();
+	uv_close((uv_handle_t *)&offsets_timer, NULL);
+}
+
+/* Write every stream's offset to the registry if any of them moved since
+ * the last checkpoint. */
+void
+checkpoint_offsets(void)
+{
+	listIter *iter;
+	listNode *node;
+	narc_stream *stream;
+	FILE *fp;
+	sds tmp;
+	int dirty = 0, ok;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		stream = (narc_stream *)listNodeValue(node);
+		if (stream->size >= 0 && stream_checkpoint_offset(stream) != stream->checkpoint)
+			dirty = 1;
+	}
+	listReleaseIterator(iter);
+
+	if (!dirty)
+		return;
+
+	tmp = sdscatprintf(sdsempty(), "%s.tmp", server.offset_registry);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		narc_log(NARC_WARNING, "Can't write offset registry %s: %s", tmp, strerror(errno));
+		sdsfree(tmp);
+		return;
+	}
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		stream = (narc_stream *)listNodeValue(node);
+		if (stream->size < 0 && !stream->resume)
+			continue;
+		if (stream->size >= 0)
+			stream->checkpoint = stream_checkpoint_offset(stream);
+		fprintf(fp, "%llu %llu %lld %s\n",
+			(unsigned long long)stream->dev,
+			(unsigned long long)stream->inode,
+			(long long)stream->checkpoint,
+			stream->file);
+	}
+	listReleaseIterator(iter);
+
+	ok = (fflush(fp) == 0 && fsync(fileno(fp)) == 0);
+	if (fclose(fp) != 0)
+		ok = 0;
+
+	if (ok) {
+		if (rename(tmp, server.offset_registry) == -1)
+			narc_log(NARC_WARNING, "Can't rename offset registry %s: %s", tmp, strerror(errno));
+	} else {
+		narc_log(NARC_WARNING, "Can't write offset registry %s: %s", tmp, strerror(errno));
+		unlink(tmp);
+	}
+	sdsfree(tmp);
+}
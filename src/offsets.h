@@ -0,0 +1,22 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_OFFSETS
+#define NARC_OFFSETS
+
+#include "narc.h"
+
+#include <uv.h>		/* Event driven programming library */
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_offsets_timer(void);
+
+/* api */
+void	init_offsets(void);
+void	clean_offsets(void);
+void	checkpoint_offsets(void);
+
+#endif
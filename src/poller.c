@@ -0,0 +1,218 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "poller.h"
+#include "stream.h"
+#include "pool.h"
+#include "hibernate.h"
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <errno.h>	/* system error numbers */
+#include <string.h>	/* string operations */
+#include <sys/stat.h>	/* data returned by the stat() function */
+#include <uv.h>		/* Event driven programming library */
+
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>	/* filesystem statistics */
+#endif
+
+/* inotify only sees the changes made through the local kernel. A file on
+ * NFS or another network filesystem, on a FUSE mount, or in the lower
+ * layer of an overlay, can grow without a single event. Such files are
+ * polled: every poll stats the path and fstats the open file, which is
+ * enough to see appends, truncation, rotation and deletion.
+ *
+ * A poll that sees the file change polls again after poll-min-interval,
+ * each one that doesn't doubles the delay up to poll-max-interval. Files
+ * being written to are picked up quickly, and thousands of idle ones
+ * only cost a few stats a second. */
+
+static int polled_streams = 0;
+static long long polls = 0;
+static long long poll_changes = 0;
+
+/*============================ Utility functions ============================ */
+
+/* Returns 1 if the file is on a filesystem inotify can miss changes on. */
+static int
+remote_filesystem(int fd)
+{
+#ifdef HAVE_SYS_VFS_H
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs) == -1)
+		return 0;
+
+	switch ((unsigned int)sfs.f_type) {
+	case 0x6969 :		/* nfs */
+	case 0x517b :		/* smb */
+	case 0xff534d42 :	/* cifs */
+	case 0xfe534d42 :	/* smb2 */
+	case 0x65735546 :	/* fuse */
+	case 0x794c7630 :	/* overlayfs */
+	case 0x01021997 :	/* 9p */
+	case 0x00c36400 :	/* ceph */
+	case 0x5346414f :	/* afs */
+	case 0x01161970 :	/* gfs2 */
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+static int
+watch_mode(narc_stream *stream)
+{
+	return stream->opts->watch != NARC_WATCH_AUTO ? stream->opts->watch : server.watch;
+}
+
+static uint64_t
+next_poll_interval(narc_stream *stream, int changed)
+{
+	uint64_t max = server.poll_max_interval;
+
+	if (max < server.poll_min_interval)
+		max = server.poll_min_interval;
+
+	if (changed)
+		return server.poll_min_interval;
+	return (stream->poll_interval * 2 > max) ? max : stream->poll_interval * 2;
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_poll_timeout(uv_timer_t *timer)
+{
+	narc_stream *stream = timer->data;
+	struct stat path_st, fd_st;
+	int changed;
+
+	polls++;
+
+	// a hibernating stream has no file open, the path tells if it changed
+	if (stream->hibernating) {
+		if (stat(stream->file, &path_st) == -1
+		    || path_st.st_dev != stream->dev
+		    || path_st.st_ino != stream->inode
+		    || path_st.st_size != stream->size)
+			changed = 1;
+		else
+			changed = 0;
+
+		stream->poll_interval = next_poll_interval(stream, changed);
+		uv_timer_start(timer, handle_poll_timeout, stream->poll_interval, 0);
+
+		// stops the poll watcher once the stream gets to open its file
+		if (changed) {
+			poll_changes++;
+			wake_stream(stream);
+		}
+		return;
+	}
+
+	if (stream->fd < 0 || fstat(stream->fd, &fd_st) == -1) {
+		stream->poll_interval = next_poll_interval(stream, 0);
+		uv_timer_start(timer, handle_poll_timeout, stream->poll_interval, 0);
+		return;
+	}
+
+	changed = (fd_st.st_size != stream->poll_size);
+	stream->poll_size     = fd_st.st_size;
+	stream->poll_interval = next_poll_interval(stream, changed);
+	uv_timer_start(timer, handle_poll_timeout, stream->poll_interval, 0);
+
+	// both stop the poll watcher, the timer isn't touched after them
+	if (stat(stream->file, &path_st) == -1) {
+		if (errno == ENOENT) {
+			narc_log(NARC_WARNING, "File deleted: %s, attempting to re-open", stream->file);
+			start_file_drain(stream);
+		}
+		return;
+	}
+
+	if (path_st.st_dev != fd_st.st_dev || path_st.st_ino != fd_st.st_ino) {
+		narc_log(NARC_WARNING, "File renamed: %s", stream->file);
+		start_file_drain(stream);
+		return;
+	}
+
+	if (changed) {
+		poll_changes++;
+		notice_file_change(stream);
+	}
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_poll_watcher(narc_stream *stream)
+{
+	struct stat st;
+
+	if (stream->poll_timer != NULL)
+		return;
+
+	stream->poll_size     = (fstat(stream->fd, &st) == 0) ? st.st_size : -1;
+	stream->poll_interval = server.poll_min_interval;
+
+	stream->poll_timer = pool_alloc(&timer_pool);
+	uv_timer_init(server.loop, stream->poll_timer);
+	stream->poll_timer->data = (void *)stream;
+	uv_timer_start(stream->poll_timer, handle_poll_timeout, stream->poll_interval, 0);
+
+	polled_streams++;
+}
+
+void
+stop_poll_watcher(narc_stream *stream)
+{
+	if (stream->poll_timer == NULL)
+		return;
+
+	close_pooled_timer(stream->poll_timer);
+	stream->poll_timer = NULL;
+	polled_streams--;
+}
+
+/*================================== API ==================================== */
+
+/* Whether the open file of the stream is polled. In the auto watch mode
+ * only files on the filesystems above are, and they keep their inotify
+ * watch too, for the changes made locally. */
+int
+use_poll_watcher(narc_stream *stream)
+{
+	switch (watch_mode(stream)) {
+	case NARC_WATCH_POLL :
+		return 1;
+	case NARC_WATCH_INOTIFY :
+		return 0;
+	}
+
+	if (!remote_filesystem(stream->fd))
+		return 0;
+
+	narc_log(NARC_NOTICE, "%s may change without inotify events, polling it", stream->file);
+	return 1;
+}
+
+int
+use_inotify_watcher(narc_stream *stream)
+{
+	return (watch_mode(stream) != NARC_WATCH_POLL);
+}
+
+sds
+cat_poll_info(sds info)
+{
+	return sdscatprintf(info,
+		"# Polling\r\n"
+		"polled_streams:%d\r\n"
+		"polls:%lld\r\n"
+		"poll_changes:%lld\r\n",
+		polled_streams,
+		polls,
+		poll_changes);
+}
@@ -0,0 +1,25 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_POLLER
+#define NARC_POLLER
+
+#include "narc.h"
+#include "stream.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_poll_watcher(narc_stream *stream);
+void	stop_poll_watcher(narc_stream *stream);
+
+/* api */
+int	use_poll_watcher(narc_stream *stream);
+int	use_inotify_watcher(narc_stream *stream);
+sds	cat_poll_info(sds info);
+
+#endif
@@ -0,0 +1,126 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "pool.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <stdlib.h>	/* standard library definitions */
+#include <uv.h>		/* Event driven programming library */
+
+/* Requests, timers and message buffers are recycled rather than going
+ * through malloc and free for every read, write and datagram. Once the
+ * pools have warmed up, shipping a line does not allocate. */
+
+narc_pool fs_req_pool    = { .name = "fs_requests",     .size = sizeof(uv_fs_t) };
+narc_pool write_req_pool = { .name = "tcp_writes",      .size = sizeof(uv_write_t) };
+narc_pool udp_send_pool  = { .name = "udp_sends",       .size = sizeof(uv_udp_send_t) };
+narc_pool timer_pool     = { .name = "timers",          .size = sizeof(uv_timer_t) };
+narc_pool buffer_pool    = { .name = "message_buffers", .size = 0 };
+
+/*============================ Utility functions ============================ */
+
+void
+free_pool_item(narc_pool *pool, void *obj)
+{
+	if (pool->size == 0)
+		sdsfree((sds)obj);
+	else
+		zfree(obj);
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_pooled_timer_close(uv_handle_t *handle)
+{
+	pool_release(&timer_pool, handle);
+}
+
+/*================================== API ==================================== */
+
+void
+*pool_alloc(narc_pool *pool)
+{
+	void *obj;
+
+	if (pool->free_count > 0) {
+		obj = pool->items[--pool->free_count];
+		pool->hits++;
+	} else {
+		obj = (pool->size == 0) ? (void *)sdsempty() : zmalloc(pool->size);
+		pool->misses++;
+	}
+
+	if (++pool->in_use > pool->high_water)
+		pool->high_water = pool->in_use;
+
+	return obj;
+}
+
+void
+pool_release(narc_pool *pool, void *obj)
+{
+	pool->in_use--;
+
+	if (pool->items == NULL)
+		pool->items = zmalloc(sizeof(void *) * NARC_POOL_MAX_FREE);
+
+	if (pool->free_count == NARC_POOL_MAX_FREE)
+		free_pool_item(pool, obj);
+	else
+		pool->items[pool->free_count++] = obj;
+}
+
+/* An empty sds to format a message into. */
+sds
+pool_buffer(void)
+{
+	return (sds)pool_alloc(&buffer_pool);
+}
+
+void
+pool_release_buffer(sds buf)
+{
+	if (sdsAllocSize(buf) > NARC_POOL_MAX_BUFFER) {
+		buffer_pool.in_use--;
+		sdsfree(buf);
+		return;
+	}
+	sdsclear(buf);
+	pool_release(&buffer_pool, buf);
+}
+
+void
+release_fs_req(uv_fs_t *req)
+{
+	uv_fs_req_cleanup(req);
+	pool_release(&fs_req_pool, req);
+}
+
+/* Close a timer that came from timer_pool, it goes back once libuv is
+ * done with it. */
+void
+close_pooled_timer(uv_timer_t *timer)
+{
+	uv_close((uv_handle_t *)timer, handle_pooled_timer_close);
+}
+
+/* Append the pool stats to an INFO style report. */
+sds
+cat_pool_info(sds info)
+{
+	narc_pool *pools[] = {&fs_req_pool, &write_req_pool, &udp_send_pool, &timer_pool, &buffer_pool};
+	unsigned int i;
+
+	info = sdscat(info, "# Pools\r\n");
+	for (i = 0; i < sizeof(pools) / sizeof(pools[0]); i++)
+		info = sdscatprintf(info, "%s:hits=%lld,misses=%lld,in_use=%d,high_water=%d\r\n",
+			pools[i]->name,
+			pools[i]->hits,
+			pools[i]->misses,
+			pools[i]->in_use,
+			pools[i]->high_water);
+	return info;
+}
@@ -0,0 +1,57 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_POOL
+#define NARC_POOL
+
+#include "narc.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* Static pool configuration */
+#define NARC_POOL_MAX_FREE	1024	/* released objects kept per pool, the rest are freed */
+#define NARC_POOL_MAX_BUFFER	1024*256	/* larger message buffers are freed on release */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* Free list of objects of one type. Every object is a separate malloc, so
+ * anything handed out can still be given to free() instead, for instance
+ * by close_handles on shutdown. A size of 0 makes it a pool of sds
+ * buffers. */
+typedef struct {
+	char		*name;		/* shown in the stats */
+	size_t		size;		/* object size, 0 for sds buffers */
+	void		**items;	/* released objects */
+	int		free_count;	/* objects in 'items' */
+	int		in_use;		/* objects handed out */
+	int		high_water;	/* most objects handed out at once */
+	long long	hits;		/* allocations served from 'items' */
+	long long	misses;		/* allocations that went to malloc */
+} narc_pool;
+
+/*-----------------------------------------------------------------------------
+ * Extern declarations
+ *----------------------------------------------------------------------------*/
+
+extern narc_pool	fs_req_pool;		/* uv_fs_t */
+extern narc_pool	write_req_pool;		/* uv_write_t */
+extern narc_pool	udp_send_pool;		/* uv_udp_send_t */
+extern narc_pool	timer_pool;		/* uv_timer_t */
+extern narc_pool	buffer_pool;		/* outgoing messages */
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+void	*pool_alloc(narc_pool *pool);
+void	pool_release(narc_pool *pool, void *obj);
+sds	pool_buffer(void);
+void	pool_release_buffer(sds buf);
+void	release_fs_req(uv_fs_t *req);
+void	close_pooled_timer(uv_timer_t *timer);
+sds	cat_pool_info(sds info);
+
+#endif
@@ -0,0 +1,247 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "registry.h"
+#include "stream.h"
+
+#include "adlist.h"	/* Linked lists */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <string.h>	/* string operations */
+
+/* server.streams keeps the streams in the order they were added, and is
+ * what everything iterates over. Lookups go through the indexes below,
+ * by path and by device and inode. Each stream remembers its
+ * node in server.streams, so taking it out doesn't walk the list.
+ *
+ * The indexes double their buckets whenever they hold as many streams
+ * as they have buckets, and never shrink. */
+
+typedef struct {
+	uint64_t	dev;
+	uint64_t	inode;
+} narc_inode_key;
+
+static narc_index by_path;
+static narc_index by_inode;
+
+/*============================ Utility functions ============================ */
+
+/* 64 bit FNV-1a */
+static uint64_t
+hash_string(const char *s)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		hash ^= (unsigned char)*s++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* splitmix64 finalizer, inode numbers are mostly sequential */
+static uint64_t
+hash_inode(uint64_t dev, uint64_t inode)
+{
+	uint64_t hash = inode ^ (dev * 0x9e3779b97f4a7c15ULL);
+
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+static int
+match_path(narc_stream *stream, const void *key)
+{
+	return !strcmp(stream->file, key);
+}
+
+static int
+match_inode(narc_stream *stream, const void *key)
+{
+	const narc_inode_key *k = key;
+
+	return (stream->dev == k->dev && stream->inode == k->inode);
+}
+
+static void
+init_index(narc_index *index, int (*match)(narc_stream *stream, const void *key))
+{
+	index->size  = NARC_REGISTRY_INITIAL_SIZE;
+	index->used  = 0;
+	index->table = zcalloc(index->size, sizeof(narc_registry_entry *));
+	index->match = match;
+}
+
+static void
+free_index(narc_index *index)
+{
+	narc_registry_entry *entry, *next;
+	unsigned long i;
+
+	for (i = 0; i < index->size; i++) {
+		for (entry = index->table[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			zfree(entry);
+		}
+	}
+	zfree(index->table);
+	index->table = NULL;
+	index->size  = 0;
+	index->used  = 0;
+}
+
+static void
+resize_index(narc_index *index, unsigned long size)
+{
+	narc_registry_entry **table = zcalloc(size, sizeof(narc_registry_entry *));
+	narc_registry_entry *entry, *next;
+	unsigned long i;
+
+	for (i = 0; i < index->size; i++) {
+		for (entry = index->table[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			entry->next = table[entry->hash & (size - 1)];
+			table[entry->hash & (size - 1)] = entry;
+		}
+	}
+	zfree(index->table);
+	index->table = table;
+	index->size  = size;
+}
+
+static void
+index_add(narc_index *index, uint64_t hash, narc_stream *stream)
+{
+	narc_registry_entry *entry = zmalloc(sizeof(narc_registry_entry));
+	unsigned long bucket;
+
+	if (index->used >= index->size)
+		resize_index(index, index->size * 2);
+
+	bucket = hash & (index->size - 1);
+	entry->stream = stream;
+	entry->hash   = hash;
+	entry->next   = index->table[bucket];
+	index->table[bucket] = entry;
+	index->used++;
+}
+
+static void
+index_remove(narc_index *index, uint64_t hash, narc_stream *stream)
+{
+	narc_registry_entry **link = &index->table[hash & (index->size - 1)];
+	narc_registry_entry *entry;
+
+	for (; (entry = *link) != NULL; link = &entry->next) {
+		if (entry->stream == stream) {
+			*link = entry->next;
+			zfree(entry);
+			index->used--;
+			return;
+		}
+	}
+}
+
+static narc_stream
+*index_find(narc_index *index, uint64_t hash, const void *key)
+{
+	narc_registry_entry *entry = index->table[hash & (index->size - 1)];
+
+	for (; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && index->match(entry->stream, key))
+			return entry->stream;
+	}
+	return NULL;
+}
+
+/*================================== API ==================================== */
+
+void
+init_registry(void)
+{
+	init_index(&by_path, match_path);
+	init_index(&by_inode, match_inode);
+}
+
+void
+clean_registry(void)
+{
+	free_index(&by_path);
+	free_index(&by_inode);
+}
+
+/* Add a stream to server.streams and the indexes. */
+void
+register_stream(narc_stream *stream)
+{
+	listAddNodeTail(server.streams, (void *)stream);
+	stream->node = listLast(server.streams);
+
+	index_add(&by_path, hash_string(stream->file), stream);
+	if (stream->inode != 0)
+		index_add(&by_inode, hash_inode(stream->dev, stream->inode), stream);
+}
+
+/* Take a stream out of server.streams and the indexes, without freeing
+ * it. */
+void
+unregister_stream(narc_stream *stream)
+{
+	if (stream->node == NULL)
+		return;
+
+	listUnlinkNode(server.streams, stream->node);
+	stream->node = NULL;
+
+	index_remove(&by_path, hash_string(stream->file), stream);
+	if (stream->inode != 0)
+		index_remove(&by_inode, hash_inode(stream->dev, stream->inode), stream);
+}
+
+/* The file of the stream turned out to be another one, keep the inode
+ * index in step. */
+void
+set_stream_inode(narc_stream *stream, uint64_t dev, uint64_t inode)
+{
+	if (stream->dev == dev && stream->inode == inode)
+		return;
+
+	if (stream->node != NULL && stream->inode != 0)
+		index_remove(&by_inode, hash_inode(stream->dev, stream->inode), stream);
+
+	stream->dev   = dev;
+	stream->inode = inode;
+
+	if (stream->node != NULL && stream->inode != 0)
+		index_add(&by_inode, hash_inode(stream->dev, stream->inode), stream);
+}
+
+/* The file of the stream was renamed, takes ownership of the new path. */
+void
+rename_stream(narc_stream *stream, sds file)
+{
+	if (stream->node != NULL)
+		index_remove(&by_path, hash_string(stream->file), stream);
+
+	sdsfree(stream->file);
+	stream->file = file;
+
+	if (stream->node != NULL)
+		index_add(&by_path, hash_string(stream->file), stream);
+}
+
+narc_stream
+*find_stream(char *file)
+{
+	return index_find(&by_path, hash_string(file), file);
+}
+
+narc_stream
+*find_stream_by_inode(uint64_t dev, uint64_t inode)
+{
+	narc_inode_key key = { dev, inode };
+
+	return index_find(&by_inode, hash_inode(dev, inode), &key);
+}
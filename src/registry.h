@@ -0,0 +1,48 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_REGISTRY
+#define NARC_REGISTRY
+
+#include "narc.h"
+#include "stream.h"
+
+#include <stdint.h>	/* fixed width integer types */
+
+/* Static registry configuration */
+#define NARC_REGISTRY_INITIAL_SIZE	16	/* buckets of an empty index, doubles as it fills */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef struct narc_registry_entry {
+	narc_stream	*stream;
+	uint64_t	hash;		/* hash of the key the stream is indexed by */
+	struct narc_registry_entry *next;
+} narc_registry_entry;
+
+/* Chained hash table of streams by one of their keys. Streams sharing a
+ * key, two paths to one inode for instance, are all indexed, lookups
+ * return one of them. */
+typedef struct {
+	narc_registry_entry **table;	/* buckets */
+	unsigned long	size;		/* buckets, a power of two */
+	unsigned long	used;		/* entries */
+	int		(*match)(narc_stream *stream, const void *key);
+} narc_index;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+void		init_registry(void);
+void		clean_registry(void);
+void		register_stream(narc_stream *stream);
+void		unregister_stream(narc_stream *stream);
+void		set_stream_inode(narc_stream *stream, uint64_t dev, uint64_t inode);
+void		rename_stream(narc_stream *stream, sds file);
+narc_stream	*find_stream(char *file);
+narc_stream	*find_stream_by_inode(uint64_t dev, uint64_t inode);
+
+#endif
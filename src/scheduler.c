@@ -0,0 +1,190 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "scheduler.h"
+#include "stream.h"
+
+#include "adlist.h"	/* Linked lists */
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <stdlib.h>	/* standard library definitions */
+#include <uv.h>		/* Event driven programming library */
+
+/* A file that filled the read buffer has more to read. Rather than
+ * reading it again straight away, which lets one busy file keep the
+ * threadpool and the send path to itself, it is queued here.
+ *
+ * The queue is served with deficit round robin. A stream earns
+ * NARC_SCHED_QUANTUM times its weight on every visit, and reads once it
+ * has earned its read size. At most read-budget bytes of scheduled reads
+ * are in flight, so the read of a quiet file, which skips the queue,
+ * only ever waits behind a few buffers. */
+
+static narc_scheduler sched;
+
+/*============================ Utility functions ============================ */
+
+/* Give the stream at the tail of the queue its turn. Returns 1 if it
+ * read, 0 if it moved to the head to wait for the next round. */
+static int
+visit_stream(narc_stream *stream)
+{
+	listNode *node = listLast(sched.ready);
+
+	stream->deficit += NARC_SCHED_QUANTUM * stream->opts->weight;
+	if (stream->deficit < stream->read_size) {
+		listRotate(sched.ready);
+		return 0;
+	}
+
+	listDelNode(sched.ready, node);
+	stream->scheduled = 0;
+	start_file_read(stream);
+
+	if (stream->lock == NARC_STREAM_LOCKED) {
+		stream->scheduled  = NARC_SCHED_READING;
+		stream->deficit   -= stream->read_size;
+		sched.in_flight   += stream->read_size;
+		sched.reads++;
+	}
+	return 1;
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_scheduler_idle(uv_idle_t *handle)
+{
+	while (!server.paused
+	    && listLength(sched.ready) > 0
+	    && sched.in_flight < server.read_budget)
+		visit_stream(listNodeValue(listLast(sched.ready)));
+
+	// nothing to do until a read comes back or the reads are resumed
+	uv_idle_stop(handle);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_scheduler(void)
+{
+	if (listLength(sched.ready) > 0 && !uv_is_active((uv_handle_t *)sched.idle))
+		uv_idle_start(sched.idle, handle_scheduler_idle);
+}
+
+/*================================== API ==================================== */
+
+void
+init_scheduler(void)
+{
+	sched.ready     = listCreate();
+	sched.paused    = listCreate();
+	sched.idle      = zmalloc(sizeof(uv_idle_t));
+	sched.in_flight = 0;
+	sched.reads     = 0;
+
+	uv_idle_init(server.loop, sched.idle);
+}
+
+void
+clean_scheduler(void)
+{
+	uv_close((uv_handle_t *)sched.idle, (uv_close_cb)zfree);
+	listRelease(sched.ready);
+	listRelease(sched.paused);
+}
+
+/* Queue the next read of a stream that has more to read. */
+void
+schedule_read(narc_stream *stream)
+{
+	if (stream->scheduled == NARC_SCHED_QUEUED)
+		return;
+
+	stream->scheduled = NARC_SCHED_QUEUED;
+	listAddNodeHead(sched.ready, stream);
+	start_scheduler();
+}
+
+/* Take a retired stream off the queue. */
+void
+unschedule_read(narc_stream *stream)
+{
+	list *queue;
+	listNode *node;
+
+	if (stream->scheduled == NARC_SCHED_QUEUED)
+		queue = sched.ready;
+	else if (stream->scheduled == NARC_SCHED_PAUSED)
+		queue = sched.paused;
+	else
+		return;
+
+	if ((node = listSearchKey(queue, stream)) != NULL)
+		listDelNode(queue, node);
+	stream->scheduled = 0;
+}
+
+/* The stream was due a read while reads are paused. Only the streams
+ * set aside here are read again when reads resume, the others have
+ * nothing waiting or are in the ready queue. */
+void
+pause_read(narc_stream *stream)
+{
+	if (stream->scheduled != 0)
+		return;
+
+	stream->scheduled = NARC_SCHED_PAUSED;
+	listAddNodeHead(sched.paused, stream);
+}
+
+/* Pick up reading where the streams stopped while reads were paused, the
+ * file watchers may have fired in the meantime. */
+void
+resume_reads(void)
+{
+	listNode *node;
+	narc_stream *stream;
+
+	while (!server.paused && (node = listLast(sched.paused)) != NULL) {
+		stream = listNodeValue(node);
+		listDelNode(sched.paused, node);
+		stream->scheduled = 0;
+		if (stream->fd >= 0 && !stream->retired)
+			start_file_read(stream);
+	}
+	start_scheduler();
+}
+
+/* Called when a read comes back, before the read size adapts to it. A
+ * stream that caught up starts the next backlog with no credit left
+ * over, as in plain DRR. */
+void
+finish_scheduled_read(narc_stream *stream, ssize_t result)
+{
+	if (stream->scheduled == NARC_SCHED_READING) {
+		stream->scheduled = 0;
+		sched.in_flight  -= stream->read_size;
+		start_scheduler();
+	}
+
+	if (result < stream->read_size)
+		stream->deficit = 0;
+}
+
+sds
+cat_scheduler_info(sds info)
+{
+	return sdscatprintf(info,
+		"# Scheduler\r\n"
+		"ready_streams:%lu\r\n"
+		"paused_streams:%lu\r\n"
+		"scheduled_reads:%lld\r\n"
+		"read_budget_in_use:%d\r\n",
+		listLength(sched.ready),
+		listLength(sched.paused),
+		sched.reads,
+		sched.in_flight);
+}
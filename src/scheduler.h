@@ -0,0 +1,53 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_SCHEDULER
+#define NARC_SCHEDULER
+
+#include "narc.h"
+#include "stream.h"
+#include "adlist.h"	/* Linked lists */
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* Static scheduler configuration */
+#define NARC_DEFAULT_STREAM_WEIGHT	1
+#define NARC_SCHED_MAX_WEIGHT		16
+#define NARC_SCHED_QUEUED		1	/* waiting in the ready queue */
+#define NARC_SCHED_READING		2	/* scheduled read in flight */
+#define NARC_SCHED_PAUSED		3	/* read skipped while reads are paused */
+#define NARC_SCHED_QUANTUM		(server.max_read_size / NARC_SCHED_MAX_WEIGHT)	/* deficit earned per visit and weight */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* Streams with a backlog wait in 'ready' for their turn to read the next
+ * buffer. The queue is served from the tail, a stream that is passed over
+ * moves to the head. */
+typedef struct {
+	list		*ready;		/* streams waiting to read */
+	list		*paused;	/* streams to read once reads are resumed */
+	uv_idle_t	*idle;		/* serves the queue, active while it's not empty */
+	int		in_flight;	/* bytes of scheduled reads not yet back */
+	long long	reads;		/* scheduled reads issued */
+} narc_scheduler;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_scheduler(void);
+
+/* api */
+void	init_scheduler(void);
+void	clean_scheduler(void);
+void	schedule_read(narc_stream *stream);
+void	unschedule_read(narc_stream *stream);
+void	pause_read(narc_stream *stream);
+void	resume_reads(void);
+void	finish_scheduled_read(narc_stream *stream, ssize_t result);
+sds	cat_scheduler_info(sds info);
+
+#endif
@@ -0,0 +1,62 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "stream.h"
+#include "split.h"
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <string.h>	/* string operations */
+
+/* The line splitter lives on its own so that bench/split_lines can link
+ * it with a stub handle_piece, and measure the code narcd runs. */
+
+/*================================== API ==================================== */
+
+/* Split a chunk of file content into lines. Newlines are located with
+ * memchr, which libc implements a word or vector register at a time, and
+ * complete lines are handed on without being copied. Only a line that is
+ * split across two reads is assembled in stream->current_line, which grows
+ * up to max-message-size. stream->offset must be the file offset of 'buf'
+ * during the call. */
+void
+split_lines(narc_stream *stream, char *buf, size_t size)
+{
+	char *p = buf, *end = buf + size, *nl;
+	int len, room, eol, full;
+
+	while (p < end) {
+		stream->line_start = stream->offset + (p - buf) - stream->index;
+
+		nl   = memchr(p, '\n', end - p);
+		len  = (nl ? nl : end) - p;
+		eol  = (nl != NULL);
+
+		// the rest of a line that was cut at max-message-size
+		if (stream->fragment > 0 && !stream->opts->split_long_lines) {
+			if (eol)
+				stream->fragment = 0;
+			p += len + eol;
+			continue;
+		}
+
+		room = stream->max_message_size - stream->index;
+		full = (len > room);
+		if (full)
+			len = room;
+
+		if (!eol && !full) {
+			stream->current_line = sdscatlen(stream->current_line, p, len);
+			stream->index += len;
+		} else if (stream->index == 0) {
+			handle_piece(stream, p, len, !full);
+		} else {
+			stream->current_line = sdscatlen(stream->current_line, p, len);
+			handle_piece(stream, stream->current_line, sdslen(stream->current_line), !full);
+			sdsclear(stream->current_line);
+			stream->index = 0;
+		}
+
+		p += len + (full ? 0 : eol);
+	}
+}
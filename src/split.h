@@ -0,0 +1,18 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_SPLIT
+#define NARC_SPLIT
+
+#include "stream.h"
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+void	split_lines(narc_stream *stream, char *buf, size_t size);
+
+/* implemented by stream.c, receives the lines split_lines finds */
+void	handle_piece(narc_stream *stream, char *line, int len, int last);
+
+#endif
@@ -0,0 +1,408 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#include "narc.h"
+#include "spool.h"
+#include "tcp_client.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <errno.h>	/* system error numbers */
+#include <fcntl.h>	/* file control options */
+#include <dirent.h>	/* directory entries */
+#include <sys/stat.h>	/* file status */
+#include <uv.h>		/* Event driven programming library */
+#include <string.h>	/* string operations */
+
+/*============================ Utility functions ============================ */
+
+sds
+spool_segment_path(uint64_t seq)
+{
+	return sdscatprintf(sdsempty(), "%s/%020llu.spool",
+		server.spool_dir, (unsigned long long)seq);
+}
+
+narc_spool
+*new_spool(void)
+{
+	narc_spool *spool = (narc_spool *)zmalloc(sizeof(narc_spool));
+
+	spool->head       = 0;
+	spool->tail       = 0;
+	spool->write_fd   = -1;
+	spool->write_size = 0;
+	spool->read_fp    = NULL;
+	spool->line       = NULL;
+	spool->line_size  = 0;
+	spool->size       = 0;
+	spool->pending    = sdsempty();
+	spool->dirty      = 0;
+	spool->write_error = 0;
+	spool->dropped     = 0;
+
+	return spool;
+}
+
+int
+spool_empty(narc_spool *spool)
+{
+	return (spool->head == spool->tail && spool->write_fd < 0 && sdslen(spool->pending) == 0);
+}
+
+/* Pick up segments left behind by a previous run. New messages always go
+ * to a fresh segment after the last one found. */
+void
+scan_spool(narc_spool *spool)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	unsigned long long seq;
+	uint64_t first = UINT64_MAX, last = 0;
+	char suffix[8];
+	sds path;
+
+	if ((dir = opendir(server.spool_dir)) == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "%llu.%6s", &seq, suffix) != 2 || strcmp(suffix, "spool"))
+			continue;
+
+		path = spool_segment_path(seq);
+		if (stat(path, &st) == 0) {
+			spool->size += st.st_size;
+			if (seq < first) first = seq;
+			if (seq > last) last = seq;
+		}
+		sdsfree(path);
+	}
+	closedir(dir);
+
+	if (first != UINT64_MAX) {
+		spool->head = first;
+		spool->tail = last + 1;
+		narc_log(NARC_NOTICE, "Spool found %lld bytes in %llu segments",
+			(long long)spool->size,
+			(unsigned long long)(spool->tail - spool->head));
+	}
+}
+
+void
+close_spool_tail(narc_spool *spool)
+{
+	if (spool->dirty)
+		fsync(spool->write_fd);
+	close(spool->write_fd);
+	spool->write_fd   = -1;
+	spool->write_size = 0;
+	spool->dirty      = 0;
+	spool->tail++;
+}
+
+/* Remove the head segment, 'size' is the number of bytes it held. */
+void
+drop_spool_head(narc_spool *spool, off_t size)
+{
+	sds path = spool_segment_path(spool->head);
+
+	if (spool->read_fp != NULL) {
+		fclose(spool->read_fp);
+		spool->read_fp = NULL;
+	}
+	if (unlink(path) == -1 && errno != ENOENT)
+		narc_log(NARC_WARNING, "Spool unlink error (%s): %s", path, strerror(errno));
+
+	spool->size -= size;
+	spool->head++;
+	sdsfree(path);
+}
+
+/* Enforce spool-max-size by throwing away the oldest complete segments. */
+void
+trim_spool(narc_spool *spool)
+{
+	struct stat st;
+	sds path;
+
+	while (spool->size > server.spool_max_size && spool->head < spool->tail) {
+		path = spool_segment_path(spool->head);
+		if (stat(path, &st) == -1)
+			st.st_size = 0;
+		narc_log(NARC_WARNING, "Spool is full, dropping %lld bytes from %s",
+			(long long)st.st_size, path);
+		sdsfree(path);
+		spool->dropped += st.st_size;
+		drop_spool_head(spool, st.st_size);
+	}
+}
+
+/* Messages the disk doesn't take are kept in memory, within the same
+ * spool-max-size as the segments. */
+void
+keep_spool_pending(narc_spool *spool)
+{
+	if (spool->size + (long long)sdslen(spool->pending) <= server.spool_max_size)
+		return;
+
+	narc_log(NARC_WARNING, "Spool is full, dropping %zu unwritten bytes",
+		sdslen(spool->pending));
+	spool->dropped += sdslen(spool->pending);
+	sdsclear(spool->pending);
+}
+
+/* Append the pending messages to the tail segment. Whatever can't be
+ * written stays pending and is retried on the next sync, up to
+ * spool-max-size bytes. */
+void
+write_spool(narc_spool *spool)
+{
+	size_t len = sdslen(spool->pending), done = 0;
+	ssize_t n;
+
+	if (len == 0)
+		return;
+
+	if (spool->write_fd < 0) {
+		sds path = spool_segment_path(spool->tail);
+		spool->write_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (spool->write_fd < 0) {
+			if (!spool->write_error)
+				narc_log(NARC_WARNING, "Spool open error (%s): %s", path, strerror(errno));
+			sdsfree(path);
+			spool->write_error = 1;
+			keep_spool_pending(spool);
+			return;
+		}
+		sdsfree(path);
+	}
+
+	while (done < len) {
+		n = write(spool->write_fd, spool->pending + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!spool->write_error)
+				narc_log(NARC_WARNING, "Spool write error: %s", strerror(errno));
+			break;
+		}
+		done += n;
+	}
+
+	// cut a failed write back to the last whole message, the rest of it
+	// is retried with the remainder
+	if (done < len && done > 0) {
+		size_t keep = done;
+
+		while (keep > 0 && spool->pending[keep - 1] != '\n')
+			keep--;
+		if (ftruncate(spool->write_fd, spool->write_size + keep) == 0)
+			done = keep;
+	}
+
+	spool->write_size += done;
+	spool->size       += done;
+	spool->dirty       = 1;
+	spool->write_error = (done < len);
+	sdsrange(spool->pending, done, -1);
+	keep_spool_pending(spool);
+
+	if (spool->write_size >= server.spool_segment_size)
+		close_spool_tail(spool);
+
+	trim_spool(spool);
+}
+
+/* Open the head segment for replay. Returns NARC_ERR if there is nothing
+ * on disk to replay. */
+int
+open_spool_head(narc_spool *spool)
+{
+	sds path;
+
+	if (spool->head == spool->tail) {
+		if (spool->write_fd < 0)
+			return NARC_ERR;
+		// the tail segment is about to be read, stop appending to it
+		close_spool_tail(spool);
+	}
+
+	path = spool_segment_path(spool->head);
+	spool->read_fp = fopen(path, "r");
+	if (spool->read_fp == NULL) {
+		narc_log(NARC_WARNING, "Spool open error (%s): %s", path, strerror(errno));
+		sdsfree(path);
+		drop_spool_head(spool, 0);
+		return NARC_OK;
+	}
+	sdsfree(path);
+
+	return NARC_OK;
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_spool_sync(uv_timer_t *timer)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+
+	write_spool(spool);
+
+	if (spool->dirty && spool->write_fd >= 0) {
+		fsync(spool->write_fd);
+		spool->dirty = 0;
+	}
+}
+
+void
+handle_spool_replay(uv_timer_t *timer)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+	int budget = server.spool_replay_rate * NARC_SPOOL_REPLAY_TICK / 1000;
+	ssize_t len;
+
+	// the tcp write queue is full, the spool waits like the files do
+	if (server.paused & NARC_PAUSE_QUEUE)
+		return;
+
+	if (budget < 1)
+		budget = 1;
+
+	while (budget > 0) {
+		if (spool->read_fp == NULL && open_spool_head(spool) == NARC_ERR) {
+			// the disk is drained, what is left never made it there
+			if (sdslen(spool->pending) > 0) {
+				replay_tcp_message(spool->pending);
+				spool->pending = sdsempty();
+			}
+			break;
+		}
+		if (spool->read_fp == NULL)
+			continue;
+
+		len = getline(&spool->line, &spool->line_size, spool->read_fp);
+		if (len <= 0) {
+			drop_spool_head(spool, ftello(spool->read_fp));
+			continue;
+		}
+
+		// a message cut short by a crash mid-append would run into the next one
+		if (spool->line[len - 1] != '\n') {
+			narc_log(NARC_WARNING, "Spool dropping %zd bytes of a partial message", len);
+			spool->dropped += len;
+			continue;
+		}
+
+		replay_tcp_message(sdsnewlen(spool->line, len));
+		budget--;
+	}
+
+	if (spool_empty(spool)) {
+		narc_log(NARC_NOTICE, "Spool drained");
+		stop_spool_replay();
+	}
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_spool_replay(void)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+
+	if (spool == NULL)
+		return;
+
+	write_spool(spool);
+
+	if (!spool_empty(spool) && !uv_is_active((uv_handle_t *)&spool->replay_timer)) {
+		narc_log(NARC_NOTICE, "Replaying %lld spooled bytes", (long long)spool->size);
+		uv_timer_start(&spool->replay_timer, handle_spool_replay, 0, NARC_SPOOL_REPLAY_TICK);
+	}
+}
+
+void
+stop_spool_replay(void)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+
+	if (spool != NULL)
+		uv_timer_stop(&spool->replay_timer);
+}
+
+/*================================== API ==================================== */
+
+void
+init_spool(void)
+{
+	narc_spool *spool;
+
+	if (server.spool_dir[0] == '\0')
+		return;
+
+	if (mkdir(server.spool_dir, 0755) == -1 && errno != EEXIST) {
+		narc_log(NARC_WARNING, "Can't create spool directory %s: %s",
+			server.spool_dir, strerror(errno));
+		return;
+	}
+
+	spool = new_spool();
+	scan_spool(spool);
+
+	uv_timer_init(server.loop, &spool->sync_timer);
+	uv_timer_init(server.loop, &spool->replay_timer);
+	uv_timer_start(&spool->sync_timer, handle_spool_sync,
+		server.spool_sync_interval, server.spool_sync_interval);
+
+	server.spool = (void *)spool;
+}
+
+void
+clean_spool(void)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+
+	if (spool == NULL)
+		return;
+
+	write_spool(spool);
+	if (spool->write_fd >= 0) {
+		if (spool->dirty)
+			fsync(spool->write_fd);
+		close(spool->write_fd);
+	}
+	if (spool->read_fp != NULL)
+		fclose(spool->read_fp);
+	sdsfree(spool->pending);
+	zlibc_free(spool->line);
+
+	uv_close((uv_handle_t *)&spool->sync_timer, NULL);
+	uv_close((uv_handle_t *)&spool->replay_timer, NULL);
+}
+
+/* Copy framed messages that could not be delivered to the spool. They
+ * are buffered in memory and written out in batches, either once
+ * NARC_SPOOL_WRITE_SIZE bytes are pending or on the sync timer. */
+void
+spool_message(char *message)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+
+	spool->pending = sdscatlen(spool->pending, message, sdslen(message));
+
+	if (sdslen(spool->pending) >= NARC_SPOOL_WRITE_SIZE && !spool->write_error)
+		write_spool(spool);
+}
+
+long long
+spool_dropped(void)
+{
+	narc_spool *spool = (narc_spool *)server.spool;
+
+	return (spool != NULL ? spool->dropped : 0);
+}
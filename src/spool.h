@@ -0,0 +1,53 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+
+#ifndef NARC_SPOOL
+#define NARC_SPOOL
+
+#include "narc.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <uv.h>		/* Event driven programming library */
+
+/* Static spool configuration */
+#define NARC_SPOOL_WRITE_SIZE	65536	/* write buffered messages once this many bytes are pending */
+#define NARC_SPOOL_REPLAY_TICK	100	/* millisecond interval between replay batches */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* Segments head .. tail - 1 are complete files on disk. Segment tail is
+ * the one being appended to and only exists while write_fd is open. */
+typedef struct {
+	uint64_t	head;		/* sequence of the oldest segment */
+	uint64_t	tail;		/* sequence of the segment being appended to */
+	int		write_fd;	/* tail segment descriptor, -1 when closed */
+	off_t		write_size;	/* bytes written to the tail segment */
+	FILE		*read_fp;	/* head segment being replayed */
+	char		*line;		/* replay line buffer */
+	size_t		line_size;	/* replay line buffer capacity */
+	off_t		size;		/* bytes on disk across all segments */
+	sds		pending;	/* messages not yet written to disk */
+	int		dirty;		/* written since the last fsync */
+	int		write_error;	/* the last write failed, retried on the next sync */
+	long long	dropped;	/* bytes thrown away, spool full or unwritable */
+	uv_timer_t	sync_timer;	/* writes and fsyncs pending messages */
+	uv_timer_t	replay_timer;	/* drains the spool once connected */
+} narc_spool;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_spool_replay(void);
+void	stop_spool_replay(void);
+
+/* api */
+void	init_spool(void);
+void	clean_spool(void);
+void	spool_message(char *message);
+long long	spool_dropped(void);
+
+#endif
@@ -2,7 +2,16 @@
 
 #include "narc.h"
 #include "stream.h"
+#include "dedup.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "catchup.h"
+#include "poller.h"
+#include "hibernate.h"
+#include "registry.h"
+#include "split.h"
 #include "sds.h"	/* dynamic safe strings */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
 
 // temporary
 #include "tcp_client.h"
@@ -25,30 +34,70 @@ file_exists(char *filename)
 	return (stat(filename, &buffer) == 0);
 }
 
+/* The path of the stream still leads to the file it last stat'd. */
+int
+same_file(narc_stream *stream)
+{
+	struct stat st;
+	return (stat(stream->file, &st) == 0 && stream->inode != 0
+		&& (uint64_t)st.st_dev == stream->dev && (uint64_t)st.st_ino == stream->inode);
+}
+
+/* Size the read buffers for reads of 'size' bytes, in chunks of at most
+ * NARC_STREAM_CHUNK bytes read together with one uv_fs_read. Each chunk
+ * has a spare byte, so a line at its end can be NUL terminated in place. */
 void
-init_buffer(uv_buf_t buffer[])
+resize_buffer(narc_stream *stream, int size)
 {
+	uv_buf_t *buf;
+	size_t len;
 	int i;
+
+	stream->read_size = size;
+	stream->buffers   = 0;
+
 	for (i = 0; i < NARC_STREAM_BUFFERS; i++) {
-		buffer[i].base = malloc(NARC_MAX_BUFF_SIZE);
-		buffer[i].len = NARC_MAX_BUFF_SIZE - 1;
-		memset(buffer[i].base, '\0', NARC_MAX_BUFF_SIZE);
+		buf = &stream->buffer[i];
+		len = (size > NARC_STREAM_CHUNK) ? NARC_STREAM_CHUNK : size;
+		size -= len;
+
+		if (len > 0) {
+			if (buf->len != len) {
+				buf->base = zrealloc(buf->base, len + 1);
+				buf->len  = len;
+			}
+			stream->buffers++;
+		} else if (buf->base != NULL) {
+			zfree(buf->base);
+			buf->base = NULL;
+			buf->len  = 0;
+		}
 	}
 }
 
+/* Double the read size after a full read, the stream is behind. Halve it
+ * once reads come back mostly empty, so idle tails keep small buffers. */
 void
-free_buffer(uv_buf_t buffer[])
+adapt_read_size(narc_stream *stream, ssize_t result)
 {
-	int i;
-	for (i = 0; i < NARC_STREAM_BUFFERS; i++) {
-		free(buffer[i].base);
-	}
+	int size = stream->read_size;
+
+	if (result == size && size < server.max_read_size)
+		size = (size * 2 > server.max_read_size) ? server.max_read_size : size * 2;
+	else if (result < size / 4 && size > NARC_MAX_BUFF_SIZE)
+		size = (size / 2 < NARC_MAX_BUFF_SIZE) ? NARC_MAX_BUFF_SIZE : size / 2;
+
+	if (size != stream->read_size)
+		resize_buffer(stream, size);
 }
 
 void
-init_line(char *line)
+free_buffer(uv_buf_t buffer[])
 {
-	memset(line, '\0', NARC_MAX_MESSAGE_SIZE);
+	int i;
+	for (i = 0; i < NARC_STREAM_BUFFERS; i++) {
+		zfree(buffer[i].base);
+	}
 }
 
 void
@@ -75,26 +124,479 @@ stream_unlocked(narc_stream *stream)
 	return (stream->lock == NARC_STREAM_UNLOCKED);
 }
 
+/* Return tokens to the stream's rate limit bucket. The bucket holds
+ * server.rate_limit tokens and is refilled at rate_limit tokens every
+ * rate_time milliseconds, measured against the loop's cached clock, so
+ * no timer is needed per message. */
+void
+refill_rate_limit(narc_stream *stream)
+{
+	uint64_t now = uv_now(server.loop);
+	uint64_t refill;
+
+	if (stream->rate_count == 0 || server.rate_time <= 0) {
+		stream->rate_count = 0;
+		stream->rate_stamp = now;
+		return;
+	}
+
+	refill = (now - stream->rate_stamp) * server.rate_limit / server.rate_time;
+	if (refill == 0)
+		return;
+
+	if (refill >= (uint64_t)stream->rate_count) {
+		stream->rate_count = 0;
+		stream->rate_stamp = now;
+	} else {
+		stream->rate_count -= refill;
+		stream->rate_stamp += refill * server.rate_time / server.rate_limit;
+	}
+}
+
+/* Stop watching the open file for changes, however it was watched. */
+void
+stop_file_watcher(narc_stream *stream)
+{
+	if (stream->fs_events != NULL) {
+		// uv_fs_event_stop(stream->fs_events);
+		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)zfree);
+		// zfree(stream->fs_events);
+		stream->fs_events = NULL;
+	}
+	stop_poll_watcher(stream);
+}
+
+/* Close the file descriptor and the file watcher, if open. */
+void
+close_stream_file(narc_stream *stream)
+{
+	if (stream->fd >= 0) {
+		uv_fs_t close_req;
+		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
+		uv_fs_req_cleanup(&close_req);
+		stream->fd = -1;
+	}
+	if (stream->next_fd >= 0) {
+		uv_fs_t close_req;
+		uv_fs_close(server.loop, &close_req, stream->next_fd, NULL);
+		uv_fs_req_cleanup(&close_req);
+		stream->next_fd = -1;
+	}
+	stop_file_watcher(stream);
+	release_open_file(stream);
+}
+
+/* Histogram of the delay from a change event to its lines being handed
+ * to the client, in log2 microsecond buckets. */
+static long long read_latency[NARC_LATENCY_BUCKETS];
+static long long fast_reads = 0;
+static long long pool_reads = 0;
+static long long change_events = 0;
+static long long file_updates = 0;
+
+void
+record_read_latency(narc_stream *stream)
+{
+	uint64_t usec = (uv_hrtime() - stream->change_stamp) / 1000;
+	int bucket = 0;
+
+	while (usec > 0 && bucket < NARC_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+	read_latency[bucket]++;
+	stream->change_stamp = 0;
+}
+
+/* Upper bound in microseconds of the bucket holding the given percentile,
+ * 0 without samples. */
+static long long
+read_latency_percentile(int percentile)
+{
+	long long total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < NARC_LATENCY_BUCKETS; i++)
+		total += read_latency[i];
+
+	for (i = 0; i < NARC_LATENCY_BUCKETS && total > 0; i++) {
+		seen += read_latency[i];
+		if (seen * 100 >= total * percentile)
+			return 1LL << i;
+	}
+	return 0;
+}
+
+/* A stat or read is in flight, or the next read is waiting its turn. */
+int
+stream_busy(narc_stream *stream)
+{
+	return (stream->requests > 0 || stream_locked(stream) || stream->scheduled);
+}
+
+/* Within change-debounce of the previous stat and read. */
+int
+stream_debouncing(narc_stream *stream)
+{
+	return (stream->change_timer != NULL && uv_is_active((uv_handle_t *)stream->change_timer));
+}
+
+/* Hand the lines of a read to the client, however it was read. */
+void
+process_file_read(narc_stream *stream, ssize_t result)
+{
+	ssize_t remaining = result;
+	size_t len;
+	int i;
+
+	if (result < 0)
+		narc_log(NARC_WARNING, "Read error (%s): %s", stream->file, uv_err_name(result));
+
+	if (result > 0) {
+		// the offset is where each buffer starts while its lines are split
+		for (i = 0; i < stream->buffers && remaining > 0; i++) {
+			len = ((size_t)remaining > stream->buffer[i].len) ? stream->buffer[i].len : (size_t)remaining;
+			split_lines(stream, stream->buffer[i].base, len);
+			stream->offset += len;
+			remaining -= len;
+		}
+		if (stream->change_stamp != 0)
+			record_read_latency(stream);
+	}
+
+	finish_file_read(stream, result);
+}
+
+/* Take in what a stat of the stream's file found. */
 void
-submit_message(narc_stream *stream, char *message)
+update_file_stat(narc_stream *stream, uv_stat_t *stat)
+{
+	// file is initially opened
+	if (stream->size < 0){
+		if (stream->resume
+		    && stream->dev == stat->st_dev
+		    && stream->inode == stat->st_ino
+		    && stream->offset <= (int64_t)stat->st_size) {
+			narc_log(NARC_NOTICE, "Resuming %s at offset %lld",
+				stream->file, (long long)stream->offset);
+		} else if (stream->resume) {
+			// rotated or truncated while we were down, all of it is new
+			narc_log(NARC_WARNING, "%s changed since the last checkpoint, reading from the start",
+				stream->file);
+			stream->offset = 0;
+		} else
+			stream->offset = stat->st_size;
+		stream->resume = 0;
+	}
+
+	set_stream_inode(stream, stat->st_dev, stat->st_ino);
+
+	// file has been truncated
+	if ((long int)stat->st_size < (long int)stream->size){
+		stream->offset = 0;
+	}
+
+	// does the file need to be truncated?
+	if ((long int)stat->st_size > (long int)server.truncate_limit){
+		stream->truncate = 1;
+	}
+
+	stream->size = stat->st_size;
+}
+
+/* Called first thing in every fs callback. Returns 1 if the stream was
+ * retired while the request was in flight, the stream is freed once its
+ * last request comes back. */
+int
+finish_stream_request(narc_stream *stream)
 {
+	stream->requests--;
+
+	if (!stream->retired)
+		return 0;
+
+	if (stream->requests == 0) {
+		close_stream_file(stream);
+		free_stream(stream);
+	}
+	return 1;
+}
+
+void
+submit_message(narc_stream *stream, char *message, int len)
+{
+	refill_rate_limit(stream);
+
 	if (stream->rate_count < server.rate_limit) {
 		if (stream->missed_count > 0) {
 			char str[81];
-			sprintf(&str[0], "Suppressed %d messages due to rate limiting", stream->missed_count);
+			int n = sprintf(&str[0], "Suppressed %d messages due to rate limiting", stream->missed_count);
 			stream->rate_count++;
-			start_rate_limit_timer(stream);
-			handle_message(stream->id, &str[0]);
+			handle_message(stream->header, &str[0], n);
 			stream->missed_count = 0;
 		}
 		stream->rate_count++;
-		start_rate_limit_timer(stream);
-		handle_message(stream->id, message);
+		handle_message(stream->header, message, len);
 	} else {
 		stream->missed_count++;
 	}
 }
 
+void
+submit_repeat_message(narc_stream *stream)
+{
+	char str[NARC_MAX_LOGMSG_LEN + 20];
+	int n = sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
+	submit_message(stream, &str[0], n);
+}
+
+/* Handle one complete line. The line is a (pointer, length) slice that is
+ * only valid for the duration of the call, it is either pointing straight
+ * into the read buffer or into stream->current_line. */
+void
+handle_line(narc_stream *stream, char *line, int len)
+{
+	if (stream->dedup != NULL) {
+		if (!dedup_line(stream, line, len))
+			submit_message(stream, line, len);
+		return;
+	}
+
+	if (len == stream->previous_length && memcmp(line, stream->previous_line, len) == 0) {
+		stream->repeat_count++;
+		if (stream->repeat_count % 500 == 0)
+			submit_repeat_message(stream);
+		return;
+	} else if (stream->repeat_count == 1) {
+		submit_message(stream, stream->previous_line, stream->previous_length);
+	} else if (stream->repeat_count > 1) {
+		submit_repeat_message(stream);
+	}
+
+	submit_message(stream, line, len);
+	stream->repeat_count = 0;
+
+	stream->previous_line   = sdscpylen(stream->previous_line, line, len);
+	stream->previous_length = len;
+}
+
+/* Lines are slices that may point into a read only mapping, so the line
+ * is matched from a terminated copy. The mapping isn't matched in place
+ * with REG_STARTEND: regexec takes a lock that a SIGBUS jump out of a
+ * truncated mapping would leave held. */
+int
+line_matches(regex_t *re, char *line, int len)
+{
+	static sds copy = NULL;
+
+	if (copy == NULL)
+		copy = sdsempty();
+	copy = sdscpylen(copy, line, len);
+
+	return (regexec(re, copy, 0, NULL, 0) == 0);
+}
+
+/* Send the pending multiline event, if any. */
+void
+flush_event(narc_stream *stream)
+{
+	if (stream->event_lines == 0)
+		return;
+
+	if (stream->event_timer != NULL)
+		uv_timer_stop(stream->event_timer);
+
+	handle_line(stream, stream->event, sdslen(stream->event));
+	sdsclear(stream->event);
+	stream->event_lines = 0;
+}
+
+/* Hand on everything the stream holds back: the pending multiline event,
+ * and the repeats of a line that were not reported yet. */
+void
+flush_stream(narc_stream *stream)
+{
+	flush_event(stream);
+
+	if (stream->dedup != NULL)
+		flush_dedup(stream, 0);
+	else if (stream->repeat_count == 1)
+		submit_message(stream, stream->previous_line, stream->previous_length);
+	else if (stream->repeat_count > 1)
+		submit_repeat_message(stream);
+	stream->repeat_count = 0;
+}
+
+/* Apply the stream's multiline rules. Lines are joined into one event
+ * until a line starts a new event, or the event reaches its line or
+ * byte limit, or nothing arrives for multiline-timeout ms. */
+void
+aggregate_line(narc_stream *stream, char *line, int len)
+{
+	narc_stream_opts *opts = stream->opts;
+	int cont, max_bytes;
+
+	if (opts->multiline_start == NULL && opts->multiline_continue == NULL) {
+		handle_line(stream, line, len);
+		return;
+	}
+
+	if (opts->multiline_start != NULL)
+		cont = !line_matches(opts->multiline_start, line, len);
+	else
+		cont = line_matches(opts->multiline_continue, line, len);
+
+	max_bytes = opts->multiline_max_bytes;
+	if (max_bytes == 0 || max_bytes > stream->max_message_size)
+		max_bytes = stream->max_message_size;
+
+	// a fragment of an oversized line never fits in an event
+	if (len > max_bytes) {
+		flush_event(stream);
+		handle_line(stream, line, len);
+		return;
+	}
+
+	if (cont && stream->event_lines > 0
+	    && stream->event_lines < opts->multiline_max_lines
+	    && sdslen(stream->event) + strlen(NARC_MULTILINE_SEPARATOR) + len <= (size_t)max_bytes) {
+		stream->event = sdscat(stream->event, NARC_MULTILINE_SEPARATOR);
+		stream->event = sdscatlen(stream->event, line, len);
+		stream->event_lines++;
+		return;
+	}
+
+	flush_event(stream);
+	stream->event = sdscatlen(stream->event, line, len);
+	stream->event_lines = 1;
+	stream->event_start = stream->line_start;
+	start_event_timer(stream);
+}
+
+/* Hand on a line, or a piece of a line longer than max-message-size.
+ * 'last' is set when the piece ends the line. With split-long-lines
+ * every piece goes out as a numbered fragment, the last one carrying the
+ * total, otherwise the first piece is sent and the rest of the line is
+ * skipped. */
+void
+handle_piece(narc_stream *stream, char *line, int len, int last)
+{
+	sds fragment;
+
+	if (stream->fragment == 0 && (last || !stream->opts->split_long_lines)) {
+		aggregate_line(stream, line, len);
+		stream->fragment = !last;
+		return;
+	}
+
+	stream->fragment++;
+	if (last)
+		fragment = sdscatprintf(sdsempty(), NARC_LAST_FRAGMENT_FORMAT, stream->fragment, stream->fragment);
+	else
+		fragment = sdscatprintf(sdsempty(), NARC_FRAGMENT_FORMAT, stream->fragment);
+	fragment = sdscatlen(fragment, line, len);
+
+	aggregate_line(stream, fragment, sdslen(fragment));
+	sdsfree(fragment);
+
+	if (last)
+		stream->fragment = 0;
+}
+
+/* Switch a draining stream over to the file that replaced the old one.
+ * Waits for the old descriptor to be read to EOF and, while the grace
+ * period runs, for the new file to be opened. */
+void
+try_file_handover(narc_stream *stream)
+{
+	if (stream->drain != NARC_STREAM_DRAINED || stream_locked(stream))
+		return;
+	if (stream->next_fd < 0 && stream->drain_timer != NULL)
+		return;
+
+	if (stream->drain_timer != NULL) {
+		close_pooled_timer(stream->drain_timer);
+		stream->drain_timer = NULL;
+	}
+
+	// the old file ended without a newline
+	if (stream->index > 0) {
+		handle_piece(stream, stream->current_line, stream->index, 1);
+		sdsclear(stream->current_line);
+		stream->index = 0;
+	}
+	// the pending event started at an offset of the old file
+	flush_event(stream);
+	stream->fragment = 0;
+
+	if (stream->fd >= 0) {
+		uv_fs_t close_req;
+		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
+		uv_fs_req_cleanup(&close_req);
+	}
+
+	narc_log(NARC_NOTICE, "Drained %s, switching to the new file", stream->file);
+
+	// everything in the new file was written after the rotation
+	stream->fd      = stream->next_fd;
+	stream->next_fd = -1;
+	stream->drain   = 0;
+	stream->offset  = 0;
+	stream->size    = 0;
+
+	if (stream->fd >= 0) {
+		start_file_watcher(stream);
+		start_file_stat(stream);
+	} else if (stream->glob != NULL && stream->open_timer == NULL) {
+		// the file is gone and no open is pending, it won't come back
+		retire_stream(stream);
+	}
+}
+
+/* A small append is read right away on the loop, with an fstat of the
+ * open file and a read, rather than a stat and a read on the threadpool.
+ * Fresh appends are in the page cache, so neither blocks for long.
+ * Returns 0 if the stream has to take the threadpool path: it is busy,
+ * behind by more than fast-read-max, or the file shrank. */
+int
+try_fast_read(narc_stream *stream)
+{
+	uv_fs_t req;
+	int64_t delta;
+	int result;
+
+	if (server.fast_read_max == 0 || stream->fd < 0 || stream->size < 0
+	    || stream->drain || stream->mmap || stream->scheduled
+	    || stream_locked(stream) || server.paused)
+		return 0;
+
+	if (uv_fs_fstat(server.loop, &req, stream->fd, NULL) < 0) {
+		uv_fs_req_cleanup(&req);
+		return 0;
+	}
+
+	delta = (int64_t)req.statbuf.st_size - stream->offset;
+	if (delta < 0 || (int64_t)req.statbuf.st_size < stream->size
+	    || delta > server.fast_read_max || delta > stream->read_size) {
+		uv_fs_req_cleanup(&req);
+		return 0;
+	}
+
+	update_file_stat(stream, &req.statbuf);
+	uv_fs_req_cleanup(&req);
+
+	if (delta == 0)
+		return 1;
+
+	lock_stream(stream);
+	result = uv_fs_read(server.loop, &req, stream->fd, stream->buffer, stream->buffers, stream->offset, NULL);
+	uv_fs_req_cleanup(&req);
+
+	fast_reads++;
+	process_file_read(stream, result);
+	return 1;
+}
+
 /*============================== Callbacks ================================= */
 
 void
@@ -102,7 +604,33 @@ handle_file_open(uv_fs_t *req)
 {
 	narc_stream *stream = req->data;
 
+	if (req->result >= 0 && stream->retired) {
+		uv_fs_t close_req;
+		uv_fs_close(server.loop, &close_req, req->result, NULL);
+		uv_fs_req_cleanup(&close_req);
+	}
+
+	if (finish_stream_request(stream)) {
+		release_fs_req(req);
+		return;
+	}
+
+	// the drain was called off, the stream followed its file under a
+	// new name
+	if (stream->fd >= 0 && !stream->drain) {
+		if (req->result >= 0) {
+			uv_fs_t close_req;
+			uv_fs_close(server.loop, &close_req, req->result, NULL);
+			uv_fs_req_cleanup(&close_req);
+		}
+		release_fs_req(req);
+		return;
+	}
+
 	if (req->result < 0) {
+		if (stream->fd < 0)
+			release_open_file(stream);
+
 		narc_log(NARC_WARNING, "Error opening %s (%d/%d): %s",
 			stream->file,
 			stream->attempts,
@@ -113,6 +641,13 @@ handle_file_open(uv_fs_t *req)
 			narc_log(NARC_WARNING, "Reached max open attempts: %s", stream->file);
 		else
 			start_file_open_timer(stream);
+	} else if (stream->drain) {
+		narc_log(NARC_WARNING, "File reopened: %s", stream->file);
+
+		stream->next_fd  = req->result;
+		stream->attempts = 0;
+
+		try_file_handover(stream);
 	} else {
 		narc_log(NARC_WARNING, "File opened: %s", stream->file);
 
@@ -123,8 +658,7 @@ handle_file_open(uv_fs_t *req)
 		start_file_stat(stream);
 	}
 
-	uv_fs_req_cleanup(req);
-	free(req);
+	release_fs_req(req);
 }
 
 void
@@ -132,8 +666,8 @@ handle_file_open_timeout(uv_timer_t* timer)
 {
 	narc_stream *stream = (narc_stream *)timer->data;
 	// uv_timer_stop(stream->open_timer);
-	uv_close((uv_handle_t *)stream->open_timer, (uv_close_cb)free);
-	// free(stream->open_timer);
+	close_pooled_timer(stream->open_timer);
+	// zfree(stream->open_timer);
 	stream->open_timer = NULL;
 	start_file_open(stream);
 }
@@ -145,69 +679,66 @@ handle_file_change(uv_fs_event_t *handle, const char *filename, int events, int
 	narc_stream *stream = handle->data;
 
 	if ((events & UV_RENAME) == UV_RENAME) {
+		// followed under its new name already
+		if (same_file(stream))
+			return;
 		narc_log(NARC_WARNING, "File renamed");
 		// File is being rotated
-		uv_fs_t close_req;
-		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
-		// uv_fs_event_stop(stream->fs_events);
-		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-		// free(stream->fs_events);
-		stream->fs_events = NULL;
-		start_file_open(stream);
-	} else if ((events & UV_CHANGE) == UV_CHANGE) {
-		if (file_exists(stream->file)) {
-			start_file_stat(stream);
-		} else {
-			narc_log(NARC_WARNING, "File deleted: %s, attempting to re-open", stream->file);
-			uv_fs_t close_req;
-			uv_fs_close(server.loop, &close_req, stream->fd, NULL);
-			// uv_fs_event_stop(stream->fs_events);
-			uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-			// free(stream->fs_events);
-			stream->fs_events = NULL;
-			start_file_open(stream);
-		}
-	}
+		start_file_drain(stream);
+	} else if ((events & UV_CHANGE) == UV_CHANGE)
+		notice_file_change(stream);
 }
 
 void
-handle_file_stat(uv_fs_t* req)
+handle_change_timeout(uv_timer_t* timer)
 {
-	narc_stream *stream = req->data;
-	if (req->result >= 0) {
-		uv_stat_t *stat  = req->ptr;
+	narc_stream *stream = timer->data;
 
-		// file is initially opened
-		if (stream->size < 0){
-			stream->offset = stat->st_size;
-		}
+	// a busy stream picks the changes up once its read is done
+	if (stream->dirty && !stream_busy(stream))
+		start_file_update(stream);
+}
 
-		// file has been truncated
-		if ((long int)stat->st_size < (long int)stream->size){
-			stream->offset = 0;
-		}
+void
+handle_event_timeout(uv_timer_t* timer)
+{
+	flush_event((narc_stream *)timer->data);
+}
 
-		// does the file need to be truncated?
-		if ((long int)stat->st_size > (long int)server.truncate_limit){
-			stream->truncate = 1;
-		}
+void
+handle_file_drain_timeout(uv_timer_t* timer)
+{
+	narc_stream *stream = (narc_stream *)timer->data;
+
+	narc_log(NARC_WARNING, "Gave up draining %s after %llu ms", stream->file,
+		(unsigned long long)server.rotate_grace_period);
+
+	close_pooled_timer(stream->drain_timer);
+	stream->drain_timer = NULL;
+	stream->drain = NARC_STREAM_DRAINED;
+	try_file_handover(stream);
+}
+
+void
+handle_file_stat(uv_fs_t* req)
+{
+	narc_stream *stream = req->data;
 
-		stream->size = stat->st_size;
+	if (finish_stream_request(stream)) {
+		release_fs_req(req);
+		return;
+	}
 
+	if (req->result >= 0) {
+		update_file_stat(stream, req->ptr);
 		start_file_read(stream);
 	} else {
 		// there was an error, try things again?
-		uv_fs_t close_req;
-		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
-		// uv_fs_event_stop(stream->fs_events);
-		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-		// free(stream->fs_events);
-		stream->fs_events = NULL;
+		close_stream_file(stream);
 		start_file_open(stream);
 	}
 
-	uv_fs_req_cleanup(req);
-	free(req);
+	release_fs_req(req);
 }
 
 void
@@ -215,76 +746,16 @@ handle_file_read(uv_fs_t *req)
 {
 	narc_stream *stream = req->data;
 
-	if (req->result < 0)
-		narc_log(NARC_WARNING, "Read error (%s): %s", stream->file, uv_err_name(req->result));
-
-	if (req->result > 0) {
-		stream->offset += req->result;
-		int i;
-		for (i = 0; i < req->result; i++) {
-			if (stream->index == 0)
-				init_line(stream->current_line);
-
-			if (stream->buffer->base[i] == '\n' || stream->index == NARC_MAX_MESSAGE_SIZE -1) {
-				stream->current_line[stream->index] = '\0';
-
-				if (strcmp(stream->current_line, stream->previous_line) == 0 ) {
-					stream->repeat_count++;
-					init_line(stream->current_line);
-					stream->index = 0;
-					if (stream->repeat_count % 500 == 0) {
-						char str[NARC_MAX_LOGMSG_LEN + 20];
-						sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
-						submit_message(stream, &str[0]);
-					}
-					continue;
-				} else if (stream->repeat_count == 1) {
-					submit_message(stream, stream->previous_line);
-				} else if (stream->repeat_count > 1) {
-					char str[NARC_MAX_LOGMSG_LEN + 20];
-					sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
-					submit_message(stream, &str[0]);
-				}
-
-				submit_message(stream, stream->current_line);
-				stream->repeat_count = 0;
-
-				char *tmp = stream->previous_line;
-				stream->previous_line = stream->current_line;
-				stream->current_line = tmp;
-
-				stream->index = 0;
-			} else {
-				stream->current_line[stream->index] = stream->buffer->base[i];
-				stream->index += 1;
-			}
-		}
-	}
+	finish_scheduled_read(stream, req->result);
 
-	if (stream->truncate == 1) {
-		if (truncate(stream->file, 0) == -1) {
-			narc_log(NARC_WARNING, "Truncate error (%s): %s", stream->file, strerror(errno));
-		}
-		stream->truncate = 0;
+	if (finish_stream_request(stream)) {
+		release_fs_req(req);
+		return;
 	}
 
-	unlock_stream(stream);
-
-	if (req->result == NARC_MAX_BUFF_SIZE -1)
-		start_file_read(stream);
-
-	uv_fs_req_cleanup(req);
-	free(req);
-}
-
-void
-handle_rate_limit_timer(uv_timer_t* timer)
-{
-	narc_stream *stream = timer->data;
-	stream->rate_count--;
-	// uv_timer_stop(timer);
-	uv_close((uv_handle_t *)timer, (uv_close_cb)free);
-	// free(timer);
+	pool_reads++;
+	process_file_read(stream, req->result);
+	release_fs_req(req);
 }
 
 /*================================= Watchers =================================== */
@@ -292,63 +763,158 @@ handle_rate_limit_timer(uv_timer_t* timer)
 void
 start_file_open(narc_stream *stream)
 {
+	if (!reserve_open_file(stream))
+		return;
+
 	narc_log(NARC_WARNING, "opening file %s", stream->file);
-	uv_fs_t *req = malloc(sizeof(uv_fs_t));
+	uv_fs_t *req = pool_alloc(&fs_req_pool);
 	if (uv_fs_open(server.loop, req, stream->file, O_RDONLY, 0, handle_file_open) == 0) {
 		req->data = (void *)stream;
 		stream->attempts += 1;
-	}
+		stream->requests++;
+	} else
+		release_fs_req(req);
 }
 
+/* Watch the open file with inotify, by polling it, or both, see the
+ * watch directive. */
 void
 start_file_watcher(narc_stream *stream)
 {
-	stream->fs_events = malloc(sizeof(uv_fs_event_t));
+	int err;
+
+	if (use_poll_watcher(stream))
+		start_poll_watcher(stream);
+
+	if (!use_inotify_watcher(stream))
+		return;
+
+	stream->fs_events = zmalloc(sizeof(uv_fs_event_t));
 	uv_fs_event_init(server.loop, stream->fs_events);
-	if (uv_fs_event_start(stream->fs_events, handle_file_change, stream->file, 0) == 0)
+	if ((err = uv_fs_event_start(stream->fs_events, handle_file_change, stream->file, 0)) == 0) {
 		stream->fs_events->data = (void *)stream;
+		return;
+	}
+
+	// out of inotify watches for instance, polling beats missing every change
+	narc_log(NARC_WARNING, "Can't watch %s (%s), polling it", stream->file, uv_err_name(err));
+	uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)zfree);
+	stream->fs_events = NULL;
+	start_poll_watcher(stream);
 }
 
 void
 start_file_open_timer(narc_stream *stream)
 {
-	stream->open_timer = malloc(sizeof(uv_timer_t));
+	stream->open_timer = pool_alloc(&timer_pool);
 	if (uv_timer_init(server.loop, stream->open_timer) == 0) {
 		if (uv_timer_start(stream->open_timer, handle_file_open_timeout, server.open_retry_delay, 0) == 0)
 			stream->open_timer->data = (void *)stream;
 	}
 }
 
+/* The file was rotated or deleted. Keep reading the old descriptor to EOF
+ * while the path is reopened, for at most rotate-grace-period ms. */
 void
-start_file_stat(narc_stream *stream)
+start_file_drain(narc_stream *stream)
 {
-	uv_fs_t *req = malloc(sizeof(uv_fs_t));
-	if (uv_fs_stat(server.loop, req, stream->file, handle_file_stat) == 0)
-		req->data = (void *)stream;
+	if (stream->drain || stream->fd < 0) {
+		if (!stream->drain) {
+			close_stream_file(stream);
+			start_file_open(stream);
+		}
+		return;
+	}
+
+	stream->drain = NARC_STREAM_DRAINING;
+
+	// the old file is read to EOF, the new one gets its own watcher
+	stop_file_watcher(stream);
+
+	stream->drain_timer = pool_alloc(&timer_pool);
+	if (uv_timer_init(server.loop, stream->drain_timer) == 0) {
+		if (uv_timer_start(stream->drain_timer, handle_file_drain_timeout, server.rotate_grace_period, 0) == 0)
+			stream->drain_timer->data = (void *)stream;
+	}
+
+	start_file_open(stream);
+	start_file_read(stream);
 }
 
+/* One stat and read for however many change events came in since the
+ * last one. */
 void
-start_file_read(narc_stream *stream)
+start_file_update(narc_stream *stream)
 {
-	if (stream_locked(stream)){
+	stream->dirty = 0;
+
+	if (!file_exists(stream->file)) {
+		narc_log(NARC_WARNING, "File deleted: %s, attempting to re-open", stream->file);
+		start_file_drain(stream);
 		return;
 	}
 
-	uv_fs_t *req = malloc(sizeof(uv_fs_t));
-	if (uv_fs_read(server.loop, req, stream->fd, stream->buffer, NARC_STREAM_BUFFERS, stream->offset, handle_file_read) == 0) {
-		lock_stream(stream);
-		req->data = (void *)stream;
+	file_updates++;
+
+	if (server.change_debounce > 0) {
+		if (stream->change_timer == NULL) {
+			stream->change_timer = pool_alloc(&timer_pool);
+			uv_timer_init(server.loop, stream->change_timer);
+			stream->change_timer->data = (void *)stream;
+		}
+		uv_timer_start(stream->change_timer, handle_change_timeout, server.change_debounce, 0);
+	}
+
+	if (!try_fast_read(stream))
+		start_file_stat(stream);
+}
+
+void
+start_event_timer(narc_stream *stream)
+{
+	if (stream->event_timer == NULL) {
+		stream->event_timer = pool_alloc(&timer_pool);
+		uv_timer_init(server.loop, stream->event_timer);
+		stream->event_timer->data = (void *)stream;
 	}
+	uv_timer_start(stream->event_timer, handle_event_timeout, stream->opts->multiline_timeout, 0);
+}
+
+void
+start_file_stat(narc_stream *stream)
+{
+	uv_fs_t *req = pool_alloc(&fs_req_pool);
+	if (uv_fs_stat(server.loop, req, stream->file, handle_file_stat) == 0) {
+		req->data = (void *)stream;
+		stream->requests++;
+	} else
+		release_fs_req(req);
 }
 
 void
-start_rate_limit_timer(narc_stream *stream)
+start_file_read(narc_stream *stream)
 {
-	uv_timer_t *timer = malloc(sizeof(uv_timer_t));
-	if (uv_timer_init(server.loop, timer) == 0) {
-		if (uv_timer_start(timer, handle_rate_limit_timer, server.rate_time, 0) == 0)
-			timer->data = (void *)stream;
+	// a stream with a backlog waits for its turn
+	if (stream_locked(stream) || stream->scheduled == NARC_SCHED_QUEUED){
+		return;
+	}
+	if (server.paused) {
+		pause_read(stream);
+		return;
+	}
+
+	if (use_mmap_read(stream)) {
+		start_mmap_read(stream);
+		return;
 	}
+
+	uv_fs_t *req = pool_alloc(&fs_req_pool);
+	if (uv_fs_read(server.loop, req, stream->fd, stream->buffer, stream->buffers, stream->offset, handle_file_read) == 0) {
+		lock_stream(stream);
+		req->data = (void *)stream;
+		stream->requests++;
+	} else
+		release_fs_req(req);
 }
 
 /*================================= API =================================== */
@@ -356,28 +922,62 @@ start_rate_limit_timer(narc_stream *stream)
 narc_stream
 *new_stream(char *id, char *file)
 {
-	narc_stream *stream = malloc(sizeof(narc_stream));
+	narc_stream *stream = zmalloc(sizeof(narc_stream));
 
 	stream->id                  = id;
 	stream->file                = file;
+	stream->fd                  = -1;
+	stream->next_fd             = -1;
+	stream->drain               = 0;
+	stream->drain_timer         = NULL;
 	stream->attempts            = 0;
 	stream->size                = -1;
 	stream->index               = 0;
+	stream->max_message_size    = server.max_message_size;
+	stream->fragment            = 0;
 	stream->lock                = NARC_STREAM_UNLOCKED;
 	stream->rate_count          = 0;
 	stream->missed_count        = 0;
+	stream->rate_stamp          = 0;
 	stream->repeat_count        = 0;
-	stream->message_header_size = strlen(id) + strlen(server.stream_id) + 24;
+	stream->previous_length     = 0;
+	stream->header              = sdscatprintf(sdsempty(), "%s ", id);
 	stream->offset              = 0;
+	stream->checkpoint          = 0;
+	stream->resume              = 0;
+	stream->dev                 = 0;
+	stream->inode               = 0;
 	stream->fs_events			= NULL;
 	stream->open_timer			= NULL;
+	stream->requests            = 0;
+	stream->retired             = 0;
+	stream->glob                = NULL;
+	stream->opts                = default_stream_opts();
+	stream->event               = sdsempty();
+	stream->event_lines         = 0;
+	stream->event_start         = 0;
+	stream->line_start          = 0;
+	stream->event_timer         = NULL;
+	stream->dedup               = NULL;
+	stream->scheduled           = 0;
+	stream->mmap                = 0;
+	stream->change_stamp        = 0;
+	stream->dirty               = 0;
+	stream->change_timer        = NULL;
+	stream->poll_timer          = NULL;
+	stream->poll_interval       = 0;
+	stream->poll_size           = -1;
+	stream->hibernating         = 0;
+	stream->last_active         = 0;
+	stream->lru_node            = NULL;
+	stream->node                = NULL;
+	stream->deficit             = 0;
 
-	stream->current_line  = &stream->line[0];
-	stream->previous_line = &stream->line[NARC_MAX_LOGMSG_LEN + 1];
-	init_line(stream->current_line);
-	init_line(stream->previous_line);
+	stream->current_line        = sdsempty();
+	stream->previous_line       = sdsempty();
 
-	init_buffer(stream->buffer);
+	memset(stream->buffer, 0, sizeof(stream->buffer));
+	resize_buffer(stream, NARC_MAX_BUFF_SIZE);
 
 	return stream;
 }
@@ -385,18 +985,27 @@ narc_stream
 void
 stop_stream(narc_stream *stream)
 {
-	if (stream->fs_events != NULL) {
-		// uv_fs_event_stop(stream->fs_events);
-		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-		// free(stream->fs_events);
-		stream->fs_events = NULL;
-	}
+	stop_file_watcher(stream);
 	if (stream->open_timer != NULL) {
 		// uv_timer_stop(stream->open_timer);
-		uv_close((uv_handle_t *)stream->open_timer, (uv_close_cb)free);
-		// free(stream->open_timer);
+		close_pooled_timer(stream->open_timer);
+		// zfree(stream->open_timer);
 		stream->open_timer = NULL;
 	}
+	if (stream->drain_timer != NULL) {
+		close_pooled_timer(stream->drain_timer);
+		stream->drain_timer = NULL;
+	}
+	if (stream->event_timer != NULL) {
+		close_pooled_timer(stream->event_timer);
+		stream->event_timer = NULL;
+	}
+	if (stream->change_timer != NULL) {
+		close_pooled_timer(stream->change_timer);
+		stream->change_timer = NULL;
+	}
+	if (stream->dedup != NULL)
+		stop_dedup(stream->dedup);
 }
 
 void
@@ -407,11 +1016,201 @@ free_stream(void *ptr)
 	free_buffer(stream->buffer);
 	sdsfree(stream->id);
 	sdsfree(stream->file);
-	free(stream);
+	sdsfree(stream->header);
+	sdsfree(stream->event);
+	sdsfree(stream->current_line);
+	sdsfree(stream->previous_line);
+	if (stream->dedup != NULL)
+		free_dedup(stream->dedup);
+	// glob streams share the options of their glob
+	if (stream->glob == NULL && stream->opts != default_stream_opts())
+		free_stream_opts(stream->opts);
+	zfree(stream);
 }
 
 void
 init_stream(narc_stream *stream)
 {
+	if (stream->opts->max_message_size > 0)
+		stream->max_message_size = stream->opts->max_message_size;
+	else
+		stream->max_message_size = server.max_message_size;
+
+	if (stream->opts->dedup_window > 0 || stream->opts->dedup_templates) {
+		stream->dedup = new_dedup(stream->opts->dedup_window > 0
+			? stream->opts->dedup_window : NARC_DEDUP_TEMPLATE_WINDOW,
+			stream->opts->dedup_templates);
+		start_dedup_timer(stream);
+	}
+
 	start_file_open(stream);
 }
+
+/* Take the stream out of server.streams and stop watching it. The stream
+ * itself is freed right away, or by finish_stream_request once the fs
+ * requests still in flight have come back. */
+static void
+release_stream(narc_stream *stream)
+{
+	unregister_stream(stream);
+
+	flush_stream(stream);
+	stop_stream(stream);
+	unschedule_read(stream);
+	forget_stream(stream);
+	stream->retired = 1;
+
+	if (stream->requests == 0) {
+		close_stream_file(stream);
+		free_stream(stream);
+	}
+}
+
+void
+retire_stream(narc_stream *stream)
+{
+	narc_log(NARC_NOTICE, "Retiring stream %s", stream->file);
+	release_stream(stream);
+}
+
+/* At shutdown, once the offsets are checkpointed. A stream with a read
+ * or a mapped window still in flight is freed when it comes back, like
+ * a retired one, and skips the scheduler, which is gone by then. */
+void
+clean_streams(void)
+{
+	listNode *node;
+	narc_stream *stream;
+
+	while ((node = listFirst(server.streams)) != NULL) {
+		stream = listNodeValue(node);
+		if (stream->scheduled == NARC_SCHED_READING)
+			stream->scheduled = 0;
+		release_stream(stream);
+	}
+}
+
+/* What follows a read, however the bytes were read: truncating the file,
+ * the rotation drain, and queueing the next read if the stream is still
+ * behind, which a full read means. */
+void
+finish_file_read(narc_stream *stream, ssize_t result)
+{
+	int behind = (result == stream->read_size);
+
+	if (result > 0)
+		touch_stream(stream);
+	if (result >= 0)
+		adapt_read_size(stream, result);
+
+	if (stream->truncate == 1 && !stream->drain) {
+		if (truncate(stream->file, 0) == -1) {
+			narc_log(NARC_WARNING, "Truncate error (%s): %s", stream->file, strerror(errno));
+		}
+		stream->truncate = 0;
+	}
+
+	unlock_stream(stream);
+
+	if (stream->drain == NARC_STREAM_DRAINING) {
+		// keep reading the rotated file until a read comes back empty
+		if (result > 0)
+			schedule_read(stream);
+		else {
+			stream->drain = NARC_STREAM_DRAINED;
+			try_file_handover(stream);
+		}
+	} else if (stream->drain == NARC_STREAM_DRAINED)
+		try_file_handover(stream);
+	else if (behind)
+		schedule_read(stream);
+	else if (stream->dirty && !stream_busy(stream) && !stream_debouncing(stream))
+		// changes came in while reading
+		start_file_update(stream);
+
+	wake_waiting_streams();
+}
+
+/* A change event came in for the stream, or a poll saw the file change.
+ * The stat and read under way, or the next one, covers it if the stream
+ * is busy. */
+void
+notice_file_change(narc_stream *stream)
+{
+	change_events++;
+	touch_stream(stream);
+	if (stream->change_stamp == 0)
+		stream->change_stamp = uv_hrtime();
+
+	if (stream_busy(stream) || stream_debouncing(stream))
+		stream->dirty = 1;
+	else
+		start_file_update(stream);
+}
+
+sds
+cat_read_info(sds info)
+{
+	return sdscatprintf(info,
+		"# Reads\r\n"
+		"change_events:%lld\r\n"
+		"file_updates:%lld\r\n"
+		"fast_reads:%lld\r\n"
+		"threadpool_reads:%lld\r\n"
+		"change_to_send_p50_usec:%lld\r\n"
+		"change_to_send_p99_usec:%lld\r\n",
+		change_events,
+		file_updates,
+		fast_reads,
+		pool_reads,
+		read_latency_percentile(50),
+		read_latency_percentile(99));
+}
+
+/* Options shared by every stream configured without any. */
+narc_stream_opts
+*default_stream_opts(void)
+{
+	static narc_stream_opts *opts = NULL;
+
+	if (opts == NULL)
+		opts = new_stream_opts();
+	return opts;
+}
+
+narc_stream_opts
+*new_stream_opts(void)
+{
+	narc_stream_opts *opts = zmalloc(sizeof(narc_stream_opts));
+
+	opts->multiline_start     = NULL;
+	opts->multiline_continue  = NULL;
+	opts->multiline_max_lines = NARC_DEFAULT_MULTILINE_MAX_LINES;
+	opts->multiline_max_bytes = 0;
+	opts->multiline_timeout   = NARC_DEFAULT_MULTILINE_TIMEOUT;
+	opts->max_message_size    = 0;
+	opts->split_long_lines    = 0;
+	opts->dedup_window        = 0;
+	opts->dedup_flush         = NARC_DEFAULT_DEDUP_FLUSH;
+	opts->dedup_templates     = 0;
+	opts->weight              = NARC_DEFAULT_STREAM_WEIGHT;
+	opts->watch               = NARC_WATCH_AUTO;
+
+	return opts;
+}
+
+void
+free_stream_opts(void *ptr)
+{
+	narc_stream_opts *opts = (narc_stream_opts *)ptr;
+
+	if (opts->multiline_start != NULL) {
+		regfree(opts->multiline_start);
+		zfree(opts->multiline_start);
+	}
+	if (opts->multiline_continue != NULL) {
+		regfree(opts->multiline_continue);
+		zfree(opts->multiline_continue);
+	}
+	zfree(opts);
+}
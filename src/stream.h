@@ -3,37 +3,117 @@
 #define NARC_STREAM
 
 #include "narc.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <regex.h>	/* regular expressions */
 #include <uv.h>
 
 /* Stream locking */
 #define NARC_STREAM_LOCKED	1
 #define NARC_STREAM_UNLOCKED	2
-#define NARC_STREAM_BUFFERS	1
+#define NARC_STREAM_BUFFERS	16		/* read buffers of a stream at most */
+#define NARC_STREAM_CHUNK	1024*64		/* bytes per read buffer at most */
+
+/* Read latency histogram */
+#define NARC_LATENCY_BUCKETS	32	/* log2 microsecond buckets */
+
+/* Rotation draining */
+#define NARC_STREAM_DRAINING	1	/* reading the rotated file to EOF */
+#define NARC_STREAM_DRAINED	2	/* waiting to switch to the new file */
+
+/* Hibernation */
+#define NARC_STREAM_ASLEEP	1	/* file closed until the next change */
+#define NARC_STREAM_DIR_WATCH	2	/* the directory watch wakes it up */
+#define NARC_STREAM_WAITING	4	/* changed, waiting for room under max-open-files */
+
+/* Multiline events */
+#define NARC_DEFAULT_MULTILINE_MAX_LINES	500
+#define NARC_DEFAULT_MULTILINE_TIMEOUT		1000	/* Millisecond delay before a pending event is sent */
+#define NARC_MULTILINE_SEPARATOR		"\\n"	/* lines of an event are joined with a literal \n */
+
+/* Duplicate suppression */
+#define NARC_DEFAULT_DEDUP_FLUSH		5000	/* Millisecond delay between repeat summaries */
+
+/* Fragments of lines longer than max-message-size */
+#define NARC_FRAGMENT_FORMAT		"[part %d] "
+#define NARC_LAST_FRAGMENT_FORMAT	"[part %d/%d] "
 
 /*-----------------------------------------------------------------------------
  * Data types
  *----------------------------------------------------------------------------*/
 
+/* Per-stream options, set with 'stream <id> <file> [<option> <value>]...'.
+ * Streams without options share the defaults. */
+typedef struct {
+	regex_t	*multiline_start;			/* a matching line starts a new event */
+	regex_t	*multiline_continue;			/* a matching line continues the current event */
+	int	multiline_max_lines;			/* lines joined into one event at most */
+	int	multiline_max_bytes;			/* bytes joined into one event at most, 0 for max-message-size */
+	uint64_t multiline_timeout;			/* millisecond delay before a pending event is sent */
+	int	max_message_size;			/* 0 for the global max-message-size */
+	int	split_long_lines;			/* split oversized lines into fragments instead of cutting them */
+	int	dedup_window;				/* distinct lines remembered, 0 compares to the previous line only */
+	uint64_t dedup_flush;				/* millisecond delay between repeat summaries */
+	int	dedup_templates;			/* group lines with numbers and ids masked */
+	int	weight;					/* share of the reads while files have a backlog */
+	int	watch;					/* NARC_WATCH_* mode, auto follows the watch directive */
+} narc_stream_opts;
+
 typedef struct {
 	char 	*id;					/* message id prefix */
 	char 	*file;					/* absolute path to the file */
 	int 	fd;					/* file descriptor */
+	int	next_fd;				/* replacement file opened while draining */
+	int	drain;					/* rotation drain state */
 	off_t 	size;					/* last known file size in bytes */
-	uv_buf_t buffer[NARC_STREAM_BUFFERS];		/* read buffer (file content) */
-	char 	line[(NARC_MAX_LOGMSG_LEN + 1) * 2];	/* the current and previous lines buffer */
-	char	*current_line;				/* current line */
-	char	*previous_line;				/* previous line */
+	uint64_t dev;					/* device of the file last stat'd */
+	uint64_t inode;					/* inode of the file last stat'd */
+	uv_buf_t buffer[NARC_STREAM_BUFFERS];		/* read buffers (file content) */
+	int	buffers;				/* buffers in use */
+	int	read_size;				/* bytes per read, grows while the stream is behind */
+	int	mmap;					/* far behind, read by mapping the file */
+	uint64_t change_stamp;				/* hrtime of the first change event not read yet, or 0 */
+	int	dirty;					/* changed since the last stat and read started */
+	uv_timer_t *change_timer;			/* change-debounce timer */
+	sds	current_line;				/* line split across reads */
+	sds	previous_line;				/* previous line */
+	int	previous_length;			/* length of the previous line */
 	int	repeat_count;				/* how many times the previous line was repeated */
 	int 	index;					/* the line character index */
+	int	max_message_size;			/* lines are cut or split beyond this many bytes */
+	int	fragment;				/* fragments sent of an oversized line */
 	int 	lock;					/* read lock to prevent resetting buffers */
 	int 	attempts;				/* open attempts */
-	int	rate_count;				/*  */
-	int	missed_count;				/*  */
-	int     message_header_size;
+	int	rate_count;				/* rate limit tokens in use */
+	uint64_t rate_stamp;				/* loop time of the last token refill */
+	int	missed_count;				/* messages suppressed by the rate limit */
+	sds	header;					/* "<id> ", what follows the shared message prefix */
 	int64_t offset;
+	int64_t checkpoint;				/* offset written to the offset registry */
+	int	resume;					/* offset was loaded from the offset registry */
 	int		truncate;
 	uv_fs_event_t *fs_events;
+	uv_timer_t *poll_timer;				/* polling watcher, or NULL */
+	uint64_t poll_interval;				/* millisecond delay until the next poll */
+	off_t	poll_size;				/* file size seen by the last poll */
+	int	hibernating;				/* NARC_STREAM_ASLEEP and how it wakes up, or 0 */
+	uint64_t last_active;				/* loop time of the last change or read */
+	void	*lru_node;				/* node in the open file lru, NULL if no file is held */
+	void	*node;					/* node in server.streams, NULL once retired */
 	uv_timer_t *open_timer;
+	uv_timer_t *drain_timer;			/* rotate-grace-period timer */
+	int	requests;				/* fs requests in flight */
+	int	retired;				/* removed, freed once requests come back */
+	void	*glob;					/* glob the stream was discovered by, or NULL */
+	narc_stream_opts *opts;				/* per-stream options */
+	sds	event;					/* multiline event being assembled */
+	int	event_lines;				/* lines in the pending event */
+	int64_t	event_start;				/* file offset of the first line of the pending event */
+	int64_t	line_start;				/* file offset of the line being handed on */
+	uv_timer_t *event_timer;			/* sends the pending event after multiline-timeout */
+	void	*dedup;					/* duplicate suppression window, or NULL */
+	int	scheduled;				/* NARC_SCHED_* state of the next read */
+	int	deficit;				/* bytes the stream may read in its turn */
 } narc_stream;
 
 /*-----------------------------------------------------------------------------
@@ -44,13 +124,31 @@ typedef struct {
 void	start_file_open(narc_stream *stream);
 void	start_file_watcher(narc_stream *stream);
 void	start_file_open_timer(narc_stream *stream);
+void	start_file_drain(narc_stream *stream);
 void	start_file_stat(narc_stream *stream);
 void	start_file_read(narc_stream *stream);
-void	start_rate_limit_timer(narc_stream *stream);
+void	start_event_timer(narc_stream *stream);
+void	start_file_update(narc_stream *stream);
+void	stop_file_watcher(narc_stream *stream);
 
 /* api */
+int		same_file(narc_stream *stream);
+void		lock_stream(narc_stream *stream);
+void		resize_buffer(narc_stream *stream, int size);
+void		update_file_stat(narc_stream *stream, uv_stat_t *stat);
+int		finish_stream_request(narc_stream *stream);
+void		finish_file_read(narc_stream *stream, ssize_t result);
+void		notice_file_change(narc_stream *stream);
+void		submit_message(narc_stream *stream, char *message, int len);
+void		flush_stream(narc_stream *stream);
 narc_stream 	*new_stream(char *id, char *file);
 void		free_stream(void *ptr);
 void		init_stream(narc_stream *stream);
+void		retire_stream(narc_stream *stream);
+void		clean_streams(void);
+sds		cat_read_info(sds info);
+narc_stream_opts *default_stream_opts(void);
+narc_stream_opts *new_stream_opts(void);
+void		free_stream_opts(void *ptr);
 
 #endif
@@ -2,9 +2,13 @@
 
 #include "narc.h"
 #include "tcp_client.h"
+#include "stream.h"
+#include "scheduler.h"
+#include "spool.h"
+#include "pool.h"
 
 #include "sds.h"	/* dynamic safe strings */
-// #include "malloc.h"	/* total memory usage aware version of malloc/free */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
 
 #include <stdio.h>	/* standard buffered input/output */
 #include <stdlib.h>	/* standard library definitions */
@@ -17,20 +21,22 @@
 void
 free_tcp_write_req(uv_write_t *req)
 {
-	sdsfree((char *)req->data);
-	free(req->bufs);
-	free(req);
+	pool_release_buffer((sds)req->data);
+	pool_release(&write_req_pool, req);
 }
 
 narc_tcp_client
 *new_tcp_client(void)
 {
-	narc_tcp_client *client = (narc_tcp_client *)malloc(sizeof(narc_tcp_client));
+	narc_tcp_client *client = (narc_tcp_client *)zmalloc(sizeof(narc_tcp_client));
 
 	client->state    = NARC_TCP_INITIALIZED;
 	client->socket   = NULL;
 	client->stream   = NULL;
 	client->attempts = 0;
+	client->pending  = pool_buffer();
+	client->pauses   = 0;
+	client->dropped  = 0;
 
 	return client;
 }
@@ -41,6 +47,61 @@ tcp_client_established(narc_tcp_client *client)
 	return (client->state == NARC_TCP_ESTABLISHED);
 }
 
+/* Bytes handed to libuv but not yet written, plus the pending batch. */
+size_t
+queued_bytes(narc_tcp_client *client)
+{
+	size_t size = sdslen(client->pending);
+
+	if (tcp_client_established(client))
+		size += uv_stream_get_write_queue_size(client->stream);
+	return size;
+}
+
+/* Stop reading files while the collector can't keep up, they hold the
+ * lines until the queue has drained to tcp-low-water. */
+void
+check_tcp_backpressure(narc_tcp_client *client)
+{
+	size_t queued = queued_bytes(client);
+
+	if (!(server.paused & NARC_PAUSE_QUEUE)) {
+		if (server.tcp_high_water > 0 && queued > (size_t)server.tcp_high_water) {
+			narc_log(NARC_NOTICE, "Write queue at %zu bytes, pausing file reads", queued);
+			server.paused |= NARC_PAUSE_QUEUE;
+			client->pauses++;
+		}
+	} else if (queued <= (size_t)server.tcp_low_water) {
+		narc_log(NARC_NOTICE, "Write queue drained to %zu bytes, resuming file reads", queued);
+		server.paused &= ~NARC_PAUSE_QUEUE;
+		if (!server.paused)
+			resume_reads();
+	}
+}
+
+/* Returns 1 if the message has to be dropped because the queue is over
+ * tcp-queue-limit, when pausing the reads was not enough. */
+int
+tcp_queue_full(narc_tcp_client *client)
+{
+	if (server.tcp_queue_limit <= 0 || queued_bytes(client) < (size_t)server.tcp_queue_limit)
+		return 0;
+
+	if (client->dropped++ == 0)
+		narc_log(NARC_WARNING, "Write queue over tcp-queue-limit, dropping messages");
+	return 1;
+}
+
+/* Write the pending batch once it is big enough, or soon. */
+void
+schedule_tcp_flush(narc_tcp_client *client)
+{
+	if (server.tcp_flush_interval == 0 || sdslen(client->pending) >= (size_t)server.tcp_batch_bytes)
+		flush_tcp_messages();
+	else
+		start_tcp_flush_timer();
+}
+
 /*=============================== Callbacks ================================= */
 
 void
@@ -48,8 +109,8 @@ handle_tcp_connect(uv_connect_t* connection, int status)
 {
 	narc_tcp_client *client = server.client;
 
-	if (status == -1) {
-		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
+	if (status < 0) {
+		uv_close((uv_handle_t *)client->socket, (uv_close_cb)zfree);
 		client->socket = NULL;
 		narc_log(NARC_WARNING, "Error connecting to %s:%d (%d/%d)",
 			server.host,
@@ -57,7 +118,14 @@ handle_tcp_connect(uv_connect_t* connection, int status)
 			client->attempts,
 			server.max_connect_attempts);
 
-		if (client->attempts == server.max_connect_attempts) {
+		if (client->attempts == server.max_connect_attempts && server.spool != NULL) {
+			narc_log(NARC_WARNING, "Reached max connect attempts: %s:%d, spooling to %s",
+				server.host,
+				server.port,
+				server.spool_dir);
+			client->attempts = 0;
+			start_tcp_connect_timer();
+		} else if (client->attempts == server.max_connect_attempts) {
 			narc_log(NARC_WARNING, "Reached max connect attempts: %s:%d",
 				server.host,
 				server.port);
@@ -73,27 +141,29 @@ handle_tcp_connect(uv_connect_t* connection, int status)
 		client->attempts = 0;
 
 		start_tcp_read(client->stream);
+		start_spool_replay();
 	}
-	free(connection);
+	zfree(connection);
 }
 
 void
 handle_tcp_write(uv_write_t* req, int status)
 {
 	free_tcp_write_req(req);
+	check_tcp_backpressure((narc_tcp_client *)server.client);
 }
 
 void
 handle_tcp_read_alloc_buffer(uv_handle_t *handle, size_t len,  struct uv_buf_t *buf)
 {
-	buf->base = malloc(len);
+	buf->base = zmalloc(len);
 	buf->len = len;
 }
 
 // uv_buf_t
 // handle_tcp_read_alloc_buffer(uv_handle_t* handle, size_t size)
 // {
-// 	return uv_buf_init(malloc(size), size);
+// 	return uv_buf_init(zmalloc(size), size);
 // }
 
 void start_tcp_resolve(void);
@@ -110,21 +180,28 @@ handle_tcp_read(uv_stream_t* tcp, ssize_t nread, const struct uv_buf_t *buf)
 			server.port);
 
 		narc_tcp_client *client = (narc_tcp_client *)server.client;
-		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
+		uv_close((uv_handle_t *)client->socket, (uv_close_cb)zfree);
 		client->socket = NULL;
 		client->state = NARC_TCP_INITIALIZED;
 
+		stop_spool_replay();
 		start_tcp_connect_timer();
 	}
 	if (buf->base)
-		free(buf->base);
+		zfree(buf->base);
 }
 
 void
 handle_tcp_connect_timeout(uv_timer_t* timer)
 {
 	start_tcp_resolve();
-	uv_close((uv_handle_t *)timer, (uv_close_cb)free);
+	close_pooled_timer(timer);
+}
+
+void
+handle_tcp_flush_timeout(uv_timer_t* timer)
+{
+	flush_tcp_messages();
 }
 
 void
@@ -157,7 +234,7 @@ void
 start_tcp_connect(struct addrinfo *res)
 {
 	narc_tcp_client *client = (narc_tcp_client *)server.client;
-	uv_tcp_t 	*socket = (uv_tcp_t *)malloc(sizeof(uv_tcp_t));
+	uv_tcp_t 	*socket = (uv_tcp_t *)zmalloc(sizeof(uv_tcp_t));
 
 	uv_tcp_init(server.loop, socket);
 	uv_tcp_keepalive(socket, 1, 60);
@@ -165,7 +242,7 @@ start_tcp_connect(struct addrinfo *res)
 	struct sockaddr_in dest;
 	uv_ip4_addr(res->ai_addr->sa_data, server.port, &dest);
 
-	uv_connect_t *connect = malloc(sizeof(uv_connect_t));
+	uv_connect_t *connect = zmalloc(sizeof(uv_connect_t));
 	if(uv_tcp_connect(connect, socket, (struct sockaddr *)&dest, handle_tcp_connect) == 0) {
 		client->socket = socket;
 		client->attempts += 1;
@@ -182,17 +259,33 @@ start_tcp_read(uv_stream_t *stream)
 void
 start_tcp_connect_timer(void)
 {
-	uv_timer_t *timer = malloc(sizeof(uv_timer_t));
+	uv_timer_t *timer = pool_alloc(&timer_pool);
 	if (uv_timer_init(server.loop, timer) == 0)
 		uv_timer_start(timer, handle_tcp_connect_timeout, server.connect_retry_delay, 0);
 }
 
+void
+start_tcp_flush_timer(void)
+{
+	narc_tcp_client *client = (narc_tcp_client *)server.client;
+	if (!uv_is_active((uv_handle_t *)&client->flush_timer))
+		uv_timer_start(&client->flush_timer, handle_tcp_flush_timeout, server.tcp_flush_interval, 0);
+}
+
 /*================================== API ==================================== */
 
 void
 init_tcp_client(void)
 {
-	server.client = (void *)new_tcp_client();
+	narc_tcp_client *client = new_tcp_client();
+
+	uv_timer_init(server.loop, &client->flush_timer);
+	server.client = (void *)client;
+
+	if (server.tcp_low_water > server.tcp_high_water) {
+		narc_log(NARC_WARNING, "tcp-low-water is above tcp-high-water, using %lld", server.tcp_high_water);
+		server.tcp_low_water = server.tcp_high_water;
+	}
 
 	start_tcp_resolve();
 }
@@ -201,28 +294,127 @@ void
 clean_tcp_client(void)
 {
 	narc_tcp_client *client = (narc_tcp_client *)server.client;
+	flush_tcp_messages();
+	uv_close((uv_handle_t *)&client->flush_timer, NULL);
 	if (client->socket != NULL) {
-		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
+		uv_close((uv_handle_t *)client->socket, (uv_close_cb)zfree);
 		client->socket = NULL;
 	}
 	// server.client = NULL;
-	// free(client);
+	// zfree(client);
 }
 
+/* Framed messages are collected in client->pending and written to the
+ * socket together, either once tcp-batch-bytes have accumulated or when
+ * the tcp-flush-interval timer fires, whichever comes first. */
 void
 submit_tcp_message(char *message)
 {
 	narc_tcp_client *client = (narc_tcp_client *)server.client;
 
 	if ( ! tcp_client_established(client) ) {
+		if (server.spool != NULL)
+			spool_message(message);
 		sdsfree(message);
 		return;
 	}
 
-	uv_write_t *req = (uv_write_t *)malloc(sizeof(uv_write_t));
-	uv_buf_t buf    = uv_buf_init(message, strlen(message));
+	if (!tcp_queue_full(client))
+		client->pending = sdscatlen(client->pending, message, sdslen(message));
+	sdsfree(message);
 
-	if (uv_write(req, client->stream, &buf, 1, handle_tcp_write) == 0)
-		req->data = (void *)message;
+	schedule_tcp_flush(client);
+}
+
+/* Messages read back from the spool, they don't go through it again.
+ * Live messages don't wait for them, only the backlog is held to
+ * spool-replay-rate. */
+void
+replay_tcp_message(char *message)
+{
+	narc_tcp_client *client = (narc_tcp_client *)server.client;
 
+	if ( ! tcp_client_established(client) ) {
+		submit_tcp_message(message);
+		return;
+	}
+
+	if (!tcp_queue_full(client))
+		client->pending = sdscatlen(client->pending, message, sdslen(message));
+	sdsfree(message);
+
+	schedule_tcp_flush(client);
+}
+
+/* Format a message straight into the pending batch, saving the message
+ * allocation submit_tcp_message needs. */
+void
+append_tcp_message(sds header, char *body, int len)
+{
+	narc_tcp_client *client = (narc_tcp_client *)server.client;
+
+	if ( ! tcp_client_established(client) ) {
+		submit_tcp_message(format_message(sdsempty(), header, body, len));
+		return;
+	}
+
+	if (tcp_queue_full(client))
+		return;
+
+	client->pending = format_message(client->pending, header, body, len);
+	schedule_tcp_flush(client);
+}
+
+void
+flush_tcp_messages(void)
+{
+	narc_tcp_client *client = (narc_tcp_client *)server.client;
+
+	uv_timer_stop(&client->flush_timer);
+
+	if (sdslen(client->pending) == 0)
+		return;
+
+	if ( ! tcp_client_established(client) ) {
+		if (server.spool != NULL)
+			spool_message(client->pending);
+		sdsclear(client->pending);
+		return;
+	}
+
+	uv_write_t *req = pool_alloc(&write_req_pool);
+	uv_buf_t buf    = uv_buf_init(client->pending, sdslen(client->pending));
+
+	if (uv_write(req, client->stream, &buf, 1, handle_tcp_write) == 0) {
+		req->data = (void *)client->pending;
+		client->pending = pool_buffer();
+		check_tcp_backpressure(client);
+	} else {
+		pool_release(&write_req_pool, req);
+		sdsclear(client->pending);
+	}
+}
+
+size_t
+tcp_queue_size(void)
+{
+	if (server.protocol != NARC_PROTO_TCP)
+		return 0;
+	return queued_bytes((narc_tcp_client *)server.client);
+}
+
+long long
+tcp_queue_pauses(void)
+{
+	if (server.protocol != NARC_PROTO_TCP)
+		return 0;
+	return ((narc_tcp_client *)server.client)->pauses;
+}
+
+long long
+tcp_queue_dropped(void)
+{
+	if (server.protocol != NARC_PROTO_TCP)
+		return 0;
+	return ((narc_tcp_client *)server.client)->dropped;
 }
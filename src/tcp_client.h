@@ -22,6 +22,10 @@ typedef struct {
 	uv_stream_t	*stream;	/* connection stream */
 	int 		attempts;	/* connection attempts */
 	uv_getaddrinfo_t resolver;
+	sds		pending;	/* framed messages waiting to be written */
+	uv_timer_t	flush_timer;	/* flushes pending after tcp-flush-interval */
+	long long	pauses;		/* times file reads were paused for backpressure */
+	long long	dropped;	/* messages dropped above tcp-queue-limit */
 } narc_tcp_client;
 
 /*-----------------------------------------------------------------------------
@@ -32,11 +36,18 @@ typedef struct {
 void	start_resolve(void);
 void	start_tcp_connect(struct addrinfo *res);
 void	start_tcp_read(uv_stream_t *stream);
+void	start_tcp_flush_timer(void);
 
 /* api */
 void	init_tcp_client(void);
 void	clean_tcp_client(void);
 void 	submit_tcp_message(char *message);
+void	replay_tcp_message(char *message);
+void	append_tcp_message(sds header, char *body, int len);
+void	flush_tcp_messages(void);
+size_t	tcp_queue_size(void);
+long long	tcp_queue_pauses(void);
+long long	tcp_queue_dropped(void);
 void	start_tcp_connect_timer(void);
 
 #endif
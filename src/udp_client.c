@@ -1,23 +1,27 @@
 // -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
 
+#include "fmacros.h"
 #include "narc.h"
 #include "udp_client.h"
+#include "pool.h"
 
 #include "sds.h"	/* dynamic safe strings */
-// #include "malloc.h"	/* total memory usage aware version of malloc/free */
+#include "zmalloc.h"	/* total memory usage aware version of malloc/free */
 
 #include <stdio.h>	/* standard buffered input/output */
 #include <stdlib.h>	/* standard library definitions */
 #include <unistd.h>	/* standard symbolic constants and types */
 #include <uv.h>		/* Event driven programming library */
 #include <string.h>
+#include <errno.h>	/* system error numbers */
+#include <sys/socket.h>	/* sendmmsg */
 
 /*============================ Utility functions ============================ */
 
 narc_udp_client
 *new_udp_client(void)
 {
-	narc_udp_client *client = (narc_udp_client *)malloc(sizeof(narc_udp_client));
+	narc_udp_client *client = (narc_udp_client *)zmalloc(sizeof(narc_udp_client));
 	memset(client, 0, sizeof(narc_udp_client));
 	return client;
 }
@@ -25,14 +29,14 @@ narc_udp_client
 void
 handle_udp_read_alloc_buffer(uv_handle_t *handle, size_t len,  struct uv_buf_t *buf)
 {
-	buf->base = malloc(len);
+	buf->base = zmalloc(len);
 	buf->len = len;
 }
 
 // uv_buf_t
 // handle_udp_read_alloc_buffer(uv_handle_t* handle, size_t size)
 // {
-// 	return uv_buf_init(malloc(size), size);
+// 	return uv_buf_init(zmalloc(size), size);
 // }
 
 void
@@ -46,7 +50,7 @@ handle_udp_read(uv_udp_t *req, ssize_t nread, const uv_buf_t *buf, const struct
 			uv_strerror(nread));
 	}
 	if (buf->base)
-		free(buf->base);
+		zfree(buf->base);
 }
 
 void
@@ -56,11 +60,14 @@ handle_udp_send(uv_udp_send_t* req, int status)
 		narc_log(NARC_WARNING, "Udp send error: %s",
 			uv_err_name(status));
 	}
-	uv_buf_t *buf = (uv_buf_t *)req->data;
-	// narc_log(NARC_WARNING, "message again: %s", buf->base);
-	sdsfree(buf->base);
-	free(buf);
-	free(req);
+	pool_release_buffer((sds)req->data);
+	pool_release(&udp_send_pool, req);
+}
+
+void
+handle_udp_flush_check(uv_check_t *handle)
+{
+	flush_udp_messages();
 }
 
 void
@@ -115,11 +122,20 @@ start_udp_bind(struct addrinfo *res)
 	uv_udp_bind(&client->socket, (struct sockaddr *)&recv_addr, 0);
 
 	client->state = NARC_UDP_BOUND;
+	uv_check_init(server.loop, &client->flush_check);
 	start_udp_read();
 
 	uv_freeaddrinfo(res);
 }
 
+void
+start_udp_flush_check(void)
+{
+	narc_udp_client *client = (narc_udp_client *)server.client;
+	if (!uv_is_active((uv_handle_t *)&client->flush_check))
+		uv_check_start(&client->flush_check, handle_udp_flush_check);
+}
+
 /*================================== API ==================================== */
 
 void
@@ -137,34 +153,133 @@ clean_udp_client(void)
 {
 	narc_udp_client *client = (narc_udp_client *)server.client;
 	// uv_udp_recv_stop((uv_udp_t *)&client->socket);
+	if (client->state == NARC_UDP_BOUND) {
+		flush_udp_messages();
+		uv_close((uv_handle_t *)&client->flush_check, NULL);
+	}
 	uv_close((uv_handle_t *)&client->socket, NULL);
 	// server.client = NULL;
 }
 
+/* Datagrams submitted during one loop iteration are gathered in
+ * client->batch and sent together from a check handle, which runs right
+ * after the loop has dispatched its I/O callbacks. */
 void
 submit_udp_message(char *message)
 {
 	if (server.client == NULL) {
-		sdsfree(message);
+		pool_release_buffer(message);
 		return;
 	}
 	narc_udp_client *client = (narc_udp_client *)server.client;
-	int len = strlen(message);
-	if (client->state == NARC_UDP_BOUND && len > 2) {
+	if (client->state == NARC_UDP_BOUND && sdslen(message) > 2) {
 
 		// we make the packet one character less so that we aren't sending the newline character
-		message[strlen(message)-1] = '\0';
-		// narc_log(NARC_WARNING, "sockaddr: %d %d %d %p", client->send_addr.sin_family, client->send_addr.sin_port, client->send_addr.sin_addr.s_addr, &client->send_addr);
-		uv_udp_send_t *req = (uv_udp_send_t *)malloc(sizeof(uv_udp_send_t));
-		memset(req, 0, sizeof(uv_udp_send_t));
-		uv_buf_t *buf = malloc(sizeof(uv_buf_t));
-		memset(buf, 0, sizeof(uv_buf_t));
-
-		*buf    = uv_buf_init(message, strlen(message));
-		req->data = (void *)buf;
-		// narc_udp_client *client = (narc_udp_client *)server.client;
-		uv_udp_send(req, &client->socket, buf, 1, (struct sockaddr *)&client->send_addr, handle_udp_send);
+		sdsIncrLen(message, -1);
+		client->batch[client->batch_count++] = message;
+
+		if (client->batch_count == NARC_UDP_BATCH_SIZE)
+			flush_udp_messages();
+		else
+			start_udp_flush_check();
 	} else {
-		sdsfree(message);
+		pool_release_buffer(message);
 	}
 }
+
+/* Queue a datagram on the libuv send queue. Only used when the socket
+ * would block, the datagram is released in handle_udp_send. */
+void
+queue_udp_message(narc_udp_client *client, char *message)
+{
+	uv_udp_send_t *req = pool_alloc(&udp_send_pool);
+	uv_buf_t buf = uv_buf_init(message, sdslen(message));
+
+	memset(req, 0, sizeof(uv_udp_send_t));
+	req->data = (void *)message;
+	if (uv_udp_send(req, &client->socket, &buf, 1, (struct sockaddr *)&client->send_addr, handle_udp_send) != 0) {
+		pool_release_buffer(message);
+		pool_release(&udp_send_pool, req);
+	}
+}
+
+/* Send as much of the batch as the socket accepts without blocking.
+ * Returns the number of datagrams consumed, failed sends are logged and
+ * count as consumed so that one bad datagram does not stall the rest. */
+int
+try_send_udp_batch(narc_udp_client *client)
+{
+	int sent = 0;
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[NARC_UDP_BATCH_SIZE];
+	struct iovec iov[NARC_UDP_BATCH_SIZE];
+	uv_os_fd_t fd;
+	int i, n;
+
+	if (uv_fileno((uv_handle_t *)&client->socket, &fd) != 0)
+		return 0;
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * client->batch_count);
+	for (i = 0; i < client->batch_count; i++) {
+		iov[i].iov_base = client->batch[i];
+		iov[i].iov_len  = sdslen(client->batch[i]);
+		msgs[i].msg_hdr.msg_name    = &client->send_addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(client->send_addr);
+		msgs[i].msg_hdr.msg_iov     = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	while (sent < client->batch_count) {
+		n = sendmmsg(fd, &msgs[sent], client->batch_count - sent, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			narc_log(NARC_WARNING, "Udp send error: %s", strerror(errno));
+			n = 1;
+		}
+		sent += n;
+	}
+#else
+	uv_buf_t buf;
+	int status;
+
+	while (sent < client->batch_count) {
+		buf = uv_buf_init(client->batch[sent], sdslen(client->batch[sent]));
+		status = uv_udp_try_send(&client->socket, &buf, 1, (struct sockaddr *)&client->send_addr);
+		if (status == UV_EAGAIN)
+			break;
+		if (status < 0)
+			narc_log(NARC_WARNING, "Udp send error: %s", uv_err_name(status));
+		sent++;
+	}
+#endif
+
+	return sent;
+}
+
+void
+flush_udp_messages(void)
+{
+	narc_udp_client *client = (narc_udp_client *)server.client;
+	int sent = 0, i;
+
+	uv_check_stop(&client->flush_check);
+
+	if (client->batch_count == 0)
+		return;
+
+	// datagrams already waiting in the libuv queue must go out first
+	if (uv_udp_get_send_queue_count(&client->socket) == 0)
+		sent = try_send_udp_batch(client);
+
+	for (i = 0; i < sent; i++)
+		pool_release_buffer(client->batch[i]);
+
+	for (i = sent; i < client->batch_count; i++)
+		queue_udp_message(client, client->batch[i]);
+
+	client->batch_count = 0;
+}
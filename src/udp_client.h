@@ -11,6 +11,10 @@
 /* connection states */
 #define NARC_UDP_INITIALIZED	0
 #define NARC_UDP_BOUND			1
+
+/* max datagrams sent in one batch */
+#define NARC_UDP_BATCH_SIZE		64
+
 /*-----------------------------------------------------------------------------
  * Data types
  *----------------------------------------------------------------------------*/
@@ -20,6 +24,9 @@ typedef struct {
 	uv_udp_t 	socket;	/* udp socket */
 	uv_getaddrinfo_t resolver;
 	struct sockaddr_in send_addr;
+	uv_check_t	flush_check;	/* flushes the batch at the end of the loop iteration */
+	char		*batch[NARC_UDP_BATCH_SIZE];	/* datagrams waiting to be sent */
+	int		batch_count;	/* number of datagrams in the batch */
 } narc_udp_client;
 
 /*-----------------------------------------------------------------------------
@@ -27,10 +34,12 @@ typedef struct {
  *----------------------------------------------------------------------------*/
 
 /* watchers */
+void	start_udp_flush_check(void);
 
 /* api */
 void	init_udp_client(void);
 void	clean_udp_client(void);
 void 	submit_udp_message(char *message);
+void	flush_udp_messages(void);
 
 #endif